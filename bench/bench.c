@@ -0,0 +1,194 @@
+/* Benchmark driver, runs kokoki workloads and compares them to a baseline.
+ *
+ * usage: bench [-r reps] [-b baseline] [-s] [-t percent] file.ki...
+ *
+ * Every workload is run once to warm up and then reps times, each run in a
+ * fresh instance. The best run is reported. A workload tells how many
+ * operations one run does with a "# ops: n" comment on its first line, the
+ * time per operation is compared to the baseline. With -s the results are
+ * written to the baseline file instead. What workloads print is discarded.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../kokoki.h"
+
+typedef struct Result {
+  char name[64];
+  double seconds, ns_per_op;
+  KGcStats gc;
+} Result;
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static char *slurp(const char *filename) {
+  FILE *fp = fopen(filename, "r");
+  if (!fp)
+    return NULL;
+  fseek(fp, 0, SEEK_END);
+  long len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *src = malloc(len + 1);
+  if (src)
+    src[fread(src, 1, len, fp)] = 0;
+  fclose(fp);
+  return src;
+}
+
+static void workload_name(char *name, size_t size, const char *filename) {
+  const char *base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
+  size_t len = strcspn(base, ".");
+  if (len >= size)
+    len = size - 1;
+  memcpy(name, base, len);
+  name[len] = 0;
+}
+
+/* One run in a fresh instance, false if evaluation failed. What the
+ * workload prints goes to quiet, so only the timing of it is measured.
+ */
+static bool run(const char *src, Result *r, int quiet) {
+  fflush(stdout);
+  int out = dup(1);
+  dup2(quiet, 1);
+  KCtx *ctx = kokoki_new(NULL);
+  KGcStats before, after;
+  kokoki_gc_stats(ctx, &before);
+  double start = now();
+  bool ok = kokoki_eval(ctx, src);
+  r->seconds = now() - start;
+  kokoki_gc_stats(ctx, &after);
+  kokoki_free(ctx);
+  fflush(stdout);
+  dup2(out, 1);
+  close(out);
+  r->gc = (KGcStats){
+      .allocations = after.allocations - before.allocations,
+      .allocated_bytes = after.allocated_bytes - before.allocated_bytes,
+      .collections = after.collections - before.collections,
+      .gc_seconds = after.gc_seconds - before.gc_seconds,
+      .max_pause = after.max_pause};
+  return ok;
+}
+
+static double baseline_get(const char *filename, const char *name) {
+  FILE *fp = fopen(filename, "r");
+  if (!fp)
+    return 0;
+  char line[256], n[64];
+  double ns = 0, v;
+  while (fgets(line, sizeof(line), fp)) {
+    if (line[0] != '#' && sscanf(line, "%63s %lf", n, &v) == 2 &&
+        !strcmp(n, name))
+      ns = v;
+  }
+  fclose(fp);
+  return ns;
+}
+
+int main(int argc, char **argv) {
+  int reps = 5, opt;
+  const char *baseline = NULL;
+  bool save = false;
+  double threshold = 25;
+  while ((opt = getopt(argc, argv, "r:b:st:")) != -1) {
+    switch (opt) {
+    case 'r':
+      reps = atoi(optarg);
+      break;
+    case 'b':
+      baseline = optarg;
+      break;
+    case 's':
+      save = true;
+      break;
+    case 't':
+      threshold = atof(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-r reps] [-b baseline] [-s] [-t percent] "
+                      "file.ki...\n", argv[0]);
+      return 2;
+    }
+  }
+  if (optind == argc || reps < 1 || (save && !baseline)) {
+    fprintf(stderr, "%s: no workloads, or -s without -b\n", argv[0]);
+    return 2;
+  }
+
+  int quiet = open("/dev/null", O_WRONLY);
+  if (quiet < 0) {
+    perror("/dev/null");
+    return 2;
+  }
+  size_t count = argc - optind;
+  Result *results = calloc(count, sizeof(Result));
+  int status = 0;
+  printf("%-12s %10s %10s %10s %9s %6s %8s %9s %8s\n", "workload", "ms",
+         "ns/op", "allocs", "alloc MB", "gcs", "gc ms", "pause ms", "change");
+  for (size_t i = 0; i < count; i++) {
+    const char *filename = argv[optind + i];
+    Result *best = &results[i];
+    workload_name(best->name, sizeof(best->name), filename);
+    char *src = slurp(filename);
+    if (!src) {
+      perror(filename);
+      return 2;
+    }
+    double ops = 1;
+    sscanf(src, "# ops: %lf", &ops);
+
+    Result r;
+    bool ok = run(src, &r, quiet); // warm up
+    best->seconds = -1;
+    for (int k = 0; ok && k < reps; k++) {
+      ok = run(src, &r, quiet);
+      if (best->seconds < 0 || r.seconds < best->seconds) {
+        r.ns_per_op = r.seconds * 1e9 / ops;
+        memcpy(r.name, best->name, sizeof(r.name));
+        *best = r;
+      }
+    }
+    free(src);
+    if (!ok) {
+      printf("%-12s FAILED\n", best->name);
+      status = 1;
+      continue;
+    }
+
+    printf("%-12s %10.2f %10.1f %10zu %9.1f %6zu %8.2f %9.2f", best->name,
+           best->seconds * 1e3, best->ns_per_op, best->gc.allocations,
+           best->gc.allocated_bytes / 1e6, best->gc.collections,
+           best->gc.gc_seconds * 1e3, best->gc.max_pause * 1e3);
+    double base = baseline && !save ? baseline_get(baseline, best->name) : 0;
+    if (base > 0) {
+      double change = (best->ns_per_op - base) / base * 100;
+      printf(" %+7.1f%%%s", change, change > threshold ? " SLOWER" : "");
+      if (change > threshold)
+        status = 1;
+    }
+    printf("\n");
+  }
+
+  if (save && !status) {
+    FILE *fp = fopen(baseline, "w");
+    if (!fp) {
+      perror(baseline);
+      return 2;
+    }
+    fprintf(fp, "# workload ns/op, written by bench -s\n");
+    for (size_t i = 0; i < count; i++)
+      fprintf(fp, "%s %.1f\n", results[i].name, results[i].ns_per_op);
+    fclose(fp);
+  }
+  free(results);
+  return status;
+}
@@ -2,18 +2,268 @@
  * A Forth like programming language.
  */
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include <time.h>
 #include "tgc/tgc.h"
 #include "kokoki.h"
 #include "color.h"
 
-static tgc_t gc;
+#ifdef KOKOKI_THREADS
+#include <pthread.h>
+#define read posix_read // kokoki has its own read
+#include <unistd.h>
+#undef read
+#endif
 
-#define RES2H_ALLOC(size) tgc_alloc(&gc, (size))
+/* Every instance has its own heap. Calls through the public API switch
+ * to the heap of the instance, so instances can run on different threads
+ * without sharing any state.
+ *
+ * Parallel words run code on several threads of one instance. The
+ * collector is paused while they run, and calls to it as well as changes
+ * to the dictionary shared by the threads are serialized with the locks.
+ */
+/* Kinds of values counted with KOKOKI_ALLOC_STATS */
+typedef enum KSite { KA_STRING, KA_ARRAY, KA_HASHMAP, KA_ERROR, KA_SITES } KSite;
+
+typedef struct KHeap {
+  tgc_t gc;
+  size_t depth; // nested calls through the API
+  uint64_t epoch; // changes when a word built into compiled code is redefined
+#ifdef KOKOKI_ALLOC_STATS
+  size_t sites[KA_SITES]; // blocks allocated for values of each kind
+#endif
+#ifdef KOKOKI_THREADS
+  pthread_mutex_t lock;      // calls to the collector
+  pthread_mutex_t dict_lock; // recursive, compiling adds words
+  bool parallel;             // parallel words are running
+  struct KPool *pool;        // workers of parallel words, started on use
+#endif
+} KHeap;
+
+static _Thread_local KHeap *heap; // heap of the instance running
+
+#ifdef KOKOKI_THREADS
+#define LOCK(m) pthread_mutex_lock(&(m))
+#define UNLOCK(m) pthread_mutex_unlock(&(m))
+#else
+#define LOCK(m) ((void)0)
+#define UNLOCK(m) ((void)0)
+#endif
+
+#ifdef KOKOKI_ALLOC_STATS
+#define COUNT_ALLOC(site) __atomic_fetch_add(&heap->sites[site], 1, __ATOMIC_RELAXED)
+#else
+#define COUNT_ALLOC(site) ((void)0)
+#endif
+
+/* The outermost call into an instance marks the bottom of the stack the
+ * collector scans, the stack above it belongs to the host.
+ */
+#define ENTER(ctx)                                                             \
+  KHeap *caller_heap = heap;                                                   \
+  heap = (ctx)->heap;                                                          \
+  if (!heap->depth++)                                                          \
+  heap->gc.bottom = __builtin_frame_address(0)
+#define LEAVE()                                                                \
+  heap->depth--;                                                               \
+  heap = caller_heap
+
+/* Allocation tells the collector what it needs to scan for pointers:
+ * leaf buffers (string bytes and other plain data) are never scanned,
+ * value arrays and structural nodes are.
+ */
+void *alloc_leaf(size_t size) {
+  LOCK(heap->lock);
+  void *ptr = tgc_alloc_opt(&heap->gc, size, TGC_LEAF, NULL);
+  UNLOCK(heap->lock);
+  return ptr;
+}
+KVal *alloc_vals(size_t n) {
+  LOCK(heap->lock);
+  KVal *vals = tgc_alloc(&heap->gc, n * sizeof(KVal));
+  UNLOCK(heap->lock);
+  return vals;
+}
+void *alloc_realloc(void *ptr, size_t size) {
+  LOCK(heap->lock);
+  ptr = tgc_realloc(&heap->gc, ptr, size);
+  UNLOCK(heap->lock);
+  return ptr;
+}
+KVal *realloc_vals(KVal *vals, size_t n) {
+  return alloc_realloc(vals, n * sizeof(KVal));
+}
+void *alloc_node(size_t size) {
+  LOCK(heap->lock);
+  void *ptr = tgc_calloc(&heap->gc, 1, size);
+  UNLOCK(heap->lock);
+  return ptr;
+}
+/* Zeroed leaf block that releases a resource with dtor when collected */
+void *alloc_dtor(size_t size, void (*dtor)(void *)) {
+  LOCK(heap->lock);
+  void *ptr = tgc_calloc_opt(&heap->gc, 1, size, TGC_LEAF, dtor);
+  UNLOCK(heap->lock);
+  return ptr;
+}
+void alloc_free(void *ptr) {
+  LOCK(heap->lock);
+  tgc_free(&heap->gc, ptr);
+  UNLOCK(heap->lock);
+}
+
+/* Arena for temporaries that don't outlive the native or eval that
+ * allocated them, like NUL terminated copies of strings for C APIs. They
+ * don't count towards collections. The arena isn't scanned, so it must
+ * not hold the only pointer to a collected block. Allocations are
+ * released in stack order with arena_mark and arena_release.
+ */
+#define ARENA_CHUNK (64 * 1024)
+
+typedef struct KArena {
+  struct KArena *prev;
+  size_t size, used;
+  char data[];
+} KArena;
+
+typedef struct KArenaMark {
+  KArena *chunk;
+  size_t used;
+} KArenaMark;
+
+void *arena_alloc(KCtx *ctx, size_t size) {
+  size = (size + 15) & ~(size_t)15;
+  KArena *a = ctx->arena;
+  if (!a || a->size - a->used < size) {
+    size_t chunk = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+    KArena *n = malloc(sizeof(KArena) + chunk);
+    if (!n) {
+      fprintf(stderr, "Out of memory");
+      exit(1);
+    }
+    *n = (KArena){.prev = a, .size = chunk};
+    ctx->arena = a = n;
+  }
+  void *p = a->data + a->used;
+  a->used += size;
+  return p;
+}
+
+KArenaMark arena_mark(KCtx *ctx) {
+  return (KArenaMark){.chunk = ctx->arena,
+                      .used = ctx->arena ? ctx->arena->used : 0};
+}
+
+void arena_release(KCtx *ctx, KArenaMark m) {
+  while (ctx->arena != m.chunk) {
+    KArena *prev = ctx->arena->prev;
+    free(ctx->arena);
+    ctx->arena = prev;
+  }
+  if (ctx->arena)
+    ctx->arena->used = m.used;
+}
+
+void kokoki_arena_reset(KCtx *ctx) { arena_release(ctx, (KArenaMark){0}); }
+
+void kokoki_gc_stats(KCtx *ctx, KGcStats *stats) {
+  KHeap *h = ctx->heap;
+  tgc_t *gc = &h->gc;
+  LOCK(h->lock);
+  *stats = (KGcStats){.heap_bytes = gc->nbytes,
+                      .objects = gc->nitems,
+                      .allocations = gc->nallocs,
+                      .allocated_bytes = gc->allocated,
+                      .collections = gc->ncollections,
+                      .gc_seconds = gc->gctime,
+                      .max_pause = gc->maxpause};
+#ifdef KOKOKI_ALLOC_STATS
+  stats->strings = h->sites[KA_STRING];
+  stats->arrays = h->sites[KA_ARRAY];
+  stats->hashmaps = h->sites[KA_HASHMAP];
+  stats->errors = h->sites[KA_ERROR];
+#endif
+  UNLOCK(h->lock);
+}
+
+void kokoki_gc_tuning(KCtx *ctx, KGcTuning *tuning) {
+  tgc_t *gc = &ctx->heap->gc;
+  LOCK(ctx->heap->lock);
+  *tuning = (KGcTuning){.growth = gc->sweepfactor,
+                        .min_heap = gc->minbytes,
+                        .nursery = gc->nursery};
+  UNLOCK(ctx->heap->lock);
+}
+
+void gc_collect(void) {
+  LOCK(heap->lock);
+  if (!heap->gc.paused) // parallel words are running
+    tgc_run(&heap->gc);
+  UNLOCK(heap->lock);
+}
+
+void kokoki_gc_collect(KCtx *ctx) {
+  ENTER(ctx);
+  gc_collect();
+  LEAVE();
+}
+
+void kokoki_gc_tune(KCtx *ctx, const KGcTuning *tuning) {
+  tgc_t *gc = &ctx->heap->gc;
+  LOCK(ctx->heap->lock);
+  if (tuning->growth > 0)
+    gc->sweepfactor = tuning->growth;
+  if (tuning->min_heap)
+    gc->minbytes = tuning->min_heap;
+  if (tuning->nursery && gc->generational)
+    gc->nursery = tuning->nursery;
+  // takes effect now, not only after the next collection
+  gc->mbytes = gc->nbytes + (size_t)(gc->nbytes * gc->sweepfactor);
+  if (gc->mbytes < gc->minbytes)
+    gc->mbytes = gc->minbytes;
+  UNLOCK(ctx->heap->lock);
+}
+
+/* With the generational collector, blocks are only collected at
+ * safepoints between running words. Any block that is changed to point
+ * to another block must be passed to gc_write, unless it was allocated
+ * after the last safepoint. The data and return stacks are scanned as
+ * roots instead.
+ */
+#ifdef KOKOKI_GC_GENERATIONAL
+#ifndef KOKOKI_GC_NURSERY
+#define KOKOKI_GC_NURSERY 8192 // blocks allocated between minor collections
+#endif
+#ifdef KOKOKI_THREADS
+#define gc_write(ptr)                                                          \
+  do {                                                                         \
+    LOCK(heap->lock);                                                            \
+    tgc_write(&heap->gc, (ptr));                                                     \
+    UNLOCK(heap->lock);                                                          \
+  } while (0)
+#else
+#define gc_write(ptr) tgc_write(&heap->gc, (ptr))
+#endif
+#define gc_safepoint(ctx)                                                      \
+  if (heap->gc.nyoung >= heap->gc.nursery ||                                   \
+      heap->gc.nbytes > heap->gc.mbytes)                                       \
+  safepoint(ctx)
+#else
+#define gc_write(ptr) ((void)0)
+#define gc_safepoint(ctx) ((void)0)
+#endif
+
+#define RES2H_ALLOC(size) alloc_leaf(size)
 #include "stdlib.h"
 
 /*
@@ -58,6 +308,17 @@ stack
   (arr str)  (-1)   join     join array of strings with separator
   (str str)  (-1)   cat      join 2 strings
 
+  files:
+  (filename) (0)    open      open file for reading
+  (file)     (-1)   close     close file
+  (file)     (+1)   read-line read next line, nil at end of file
+  (filename code) (-2) each-line  run code with each line of file
+
+  output:
+  (val)      (-1)   .         print value
+             (0)    nl        print newline
+             (0)    flush     write buffered output now
+
  */
 
 
@@ -80,6 +341,31 @@ uint32_t hash_ptr(void *ptr) {
 uint32_t hash_num(double num) {
   return hash_str((KString){.len = sizeof(double), .data = (char*)&num});
 }
+uint32_t hash_int(int64_t num) {
+  return hash_str((KString){.len = sizeof(int64_t), .data = (char*)&num});
+}
+
+/* Hashes of arrays and hashmaps are cached until they are modified. The
+ * cache is only kept when they contain no arrays, hashmaps or vectors, as
+ * changes to those wouldn't clear it.
+ */
+bool is_container(KVal v) {
+  return v.type == KT_ARRAY || v.type == KT_HASHMAP || v.type == KT_VECTOR;
+}
+
+uint32_t cache_hash(uint32_t *cache, uint32_t h, bool cacheable) {
+  h = h ? h : 1; // 0 means not cached
+  if (cacheable)
+    *cache = h;
+  return h;
+}
+
+KVal vec_get(KVector *v, size_t i);
+
+/* Doubles holding an integer exactly, only these equal an integer */
+bool num_is_int(double n) {
+  return n >= (double)INT64_MIN && n < (double)INT64_MAX && n == (int64_t)n;
+}
 
 uint32_t kval_hash(KVal v) { // MurmurOAAT_32
   switch (v.type) {
@@ -90,20 +376,70 @@ uint32_t kval_hash(KVal v) { // MurmurOAAT_32
   case KT_NIL:
     return -1;
   case KT_STRING:
+    return hash_str(kval_str(&v));
   case KT_NAME:
   case KT_REF_NAME:
-    return hash_str(v.data.string);
-  case KT_ARRAY:
-    return hash_ptr(v.data.array);
-  case KT_HASHMAP:
-    return -42069; // FIXME
+    return v.data.symbol->hash;
+  case KT_ARRAY: {
+    KArray *arr = v.data.array;
+    if (arr->hash)
+      return arr->hash;
+    uint32_t h = SEED;
+    bool cacheable = true;
+    for (size_t i = 0; i < arr->size; i++) {
+      h ^= kval_hash(arr->items[i]);
+      h *= 0x5bd1e995;
+      h ^= h >> 15;
+      cacheable = cacheable && !is_container(arr->items[i]);
+    }
+    return cache_hash(&arr->hash, h, cacheable);
+  }
+  case KT_VECTOR: {
+    // same as an array of the numbers, equal vectors of both types match
+    uint32_t h = SEED;
+    for (size_t i = 0; i < v.data.vector->size; i++) {
+      h ^= kval_hash(vec_get(v.data.vector, i));
+      h *= 0x5bd1e995;
+      h ^= h >> 15;
+    }
+    return h ? h : 1;
+  }
+  case KT_HASHMAP: {
+    KHashMap *hm = v.data.hashmap;
+    if (hm->hash)
+      return hm->hash;
+    // order independent, so equal maps hash the same
+    uint32_t h = 42069;
+    bool cacheable = true;
+    for (size_t i = 0; i < hm->capacity; i++) {
+      KHashMapEntry *e = &hm->items[i];
+      if (e->dist) {
+        h += e->hash ^ (kval_hash(e->value) * 0x5bd1e995);
+        cacheable = cacheable && !is_container(e->key) &&
+                    !is_container(e->value);
+      }
+    }
+    return cache_hash(&hm->hash, h, cacheable);
+  }
   case KT_NUMBER: {
-    return hash_num(v.data.number);
+    // integral doubles must hash the same as the equal integer
+    double n = v.data.number;
+    if (num_is_int(n))
+      return hash_int((int64_t)n);
+    return hash_num(n);
   }
+  case KT_INT:
+    return hash_int(v.data.integer);
   case KT_NATIVE:
-    return hash_ptr(v.data.native);
+    return hash_ptr((void *)v.data.native);
   case KT_REF_VALUE:
     return hash_ptr(v.data.ref);
+  case KT_WORD:
+    return hash_ptr(v.data.word);
+  case KT_FILE:
+    return hash_ptr(v.data.file);
+  case KT_SEQ:
+    return hash_ptr(v.data.seq);
 
   default: return 0;// ERROR, EOF, KT_DEFINIION don't have hash
   }
@@ -114,15 +450,98 @@ uint32_t kval_hash(KVal v) { // MurmurOAAT_32
 #define err(val, fmt, ...)                                                     \
   {                                                                            \
     (val).type = KT_ERROR;                                                     \
+    (val).small = 0;                                                           \
     size_t _errlen = (size_t)snprintf(NULL, 0, fmt VA_ARGS(__VA_ARGS__));      \
     (val).data.string.len = _errlen;                                           \
-    (val).data.string.data = tgc_alloc(&gc, _errlen + 1);                      \
+    (val).slice = KS_NONE;                                                     \
+    (val).data.string.data = alloc_leaf(_errlen + 1);                          \
+    COUNT_ALLOC(KA_ERROR);                                                     \
     snprintf((val).data.string.data, _errlen + 1, fmt VA_ARGS(__VA_ARGS__));   \
   }
 
 bool falsy(KVal v) { return (v.type == KT_FALSE || v.type == KT_NIL); }
 
+bool is_number(KVal v) { return v.type == KT_INT || v.type == KT_NUMBER; }
+
+double kval_number(KVal v) {
+  switch (v.type) {
+  case KT_INT:
+    return (double)v.data.integer;
+  case KT_NUMBER:
+    return v.data.number;
+  default:
+    return 0;
+  }
+}
+
+/* Integer value of number, doubles are truncated */
+int64_t kval_int(KVal v) {
+  return v.type == KT_INT ? v.data.integer : (int64_t)kval_number(v);
+}
+
+KVal int_val(int64_t i) { return (KVal){.type = KT_INT, .data.integer = i}; }
+
+KVal bool_val(bool b) { return (KVal){.type = b ? KT_TRUE : KT_FALSE}; }
+
+int64_t int_mod(int64_t a, int64_t b) {
+  return b == -1 ? 0 : a % b; // INT64_MIN % -1 traps
+}
+
+/* Vectors */
+
+KVector *vec_new(KType type, size_t size) {
+  KVector *v = alloc_leaf(sizeof(KVector) + size * sizeof(int64_t));
+  COUNT_ALLOC(KA_ARRAY);
+  if (!v) {
+    fprintf(stderr, "Out of memory");
+    exit(1);
+  }
+  v->size = size;
+  v->type = type;
+  v->items.ints = (int64_t *)(v + 1);
+  return v;
+}
+
+KVal vec_val(KVector *v) {
+  return (KVal){.type = KT_VECTOR, .data.vector = v};
+}
+
+KVal vec_get(KVector *v, size_t i) {
+  return v->type == KT_INT
+             ? int_val(v->items.ints[i])
+             : (KVal){.type = KT_NUMBER, .data.number = v->items.numbers[i]};
+}
+
+/* Store number n, converted to the type of the vector */
+void vec_set(KVector *v, size_t i, KVal n) {
+  if (v->type == KT_INT)
+    v->items.ints[i] = kval_int(n);
+  else
+    v->items.numbers[i] = kval_number(n);
+}
+
+KVector *vec_copy(KVector *v) {
+  KVector *c = vec_new(v->type, v->size);
+  memcpy(c->items.ints, v->items.ints, v->size * sizeof(int64_t));
+  return c;
+}
+
+bool hm_eq(KHashMap *a, KHashMap *b);
+
+/* Containers with different cached hashes can't be equal */
+bool hash_may_eq(uint32_t a, uint32_t b) { return !a || !b || a == b; }
+
 bool kval_eq(KVal a, KVal b) {
+  if (is_number(a) && is_number(b)) {
+    if (a.type == KT_INT && b.type == KT_INT)
+      return a.data.integer == b.data.integer;
+    if (a.type == KT_NUMBER && b.type == KT_NUMBER)
+      return a.data.number == b.data.number;
+    // exactly, not rounding the integer to a double
+    double n = a.type == KT_NUMBER ? a.data.number : b.data.number;
+    int64_t i = a.type == KT_INT ? a.data.integer : b.data.integer;
+    return num_is_int(n) && (int64_t)n == i;
+  }
   if (a.type != b.type)
     return false;
   switch (a.type) {
@@ -134,23 +553,29 @@ bool kval_eq(KVal a, KVal b) {
     return true;
 
     // string, number, check value
-  case KT_STRING:
   case KT_NAME:
-  case KT_ERROR:
   case KT_REF_NAME:
-    if (a.data.string.len != b.data.string.len)
-      return false;
-    return memcmp(a.data.string.data, b.data.string.data, a.data.string.len) ==
-           0;
+    return a.data.symbol == b.data.symbol;
+  case KT_STRING:
+  case KT_ERROR: {
+    KString as = kval_str(&a), bs = kval_str(&b);
+    return as.len == bs.len && memcmp(as.data, bs.data, as.len) == 0;
+  }
   case KT_REF_VALUE:
     return a.data.ref == b.data.ref;
-
-  case KT_NUMBER:
-    return a.data.number == b.data.number;
+  case KT_WORD:
+    return a.data.word == b.data.word;
+  case KT_FILE:
+    return a.data.file == b.data.file;
+  case KT_SEQ:
+    return a.data.seq == b.data.seq;
 
     // arrays and hashmaps, compare contents
   case KT_ARRAY:
-    if (a.data.array->size != b.data.array->size)
+    if (a.data.array == b.data.array)
+      return true;
+    if (a.data.array->size != b.data.array->size ||
+        !hash_may_eq(a.data.array->hash, b.data.array->hash))
       return false;
     for (size_t i = 0; i < a.data.array->size; i++) {
       if (!kval_eq(a.data.array->items[i], b.data.array->items[i])) {
@@ -159,9 +584,21 @@ bool kval_eq(KVal a, KVal b) {
     }
     return true;
 
+  case KT_VECTOR:
+    if (a.data.vector->size != b.data.vector->size)
+      return false;
+    for (size_t i = 0; i < a.data.vector->size; i++) {
+      if (!kval_eq(vec_get(a.data.vector, i), vec_get(b.data.vector, i)))
+        return false;
+    }
+    return true;
+
   case KT_HASHMAP:
-    // FIXME
-    return false;
+    if (a.data.hashmap == b.data.hashmap)
+      return true;
+    if (!hash_may_eq(a.data.hashmap->hash, b.data.hashmap->hash))
+      return false;
+    return hm_eq(a.data.hashmap, b.data.hashmap);
 
   case KT_NATIVE:
     return a.data.native == b.data.native;
@@ -174,66 +611,166 @@ bool kval_eq(KVal a, KVal b) {
 
 void kval_dump(KVal v);
 
-void hm_put(KHashMap *hm, KVal key, KVal value) {
-  uint32_t hash = kval_hash(key);
-  size_t idx;
-  if (hm->size == hm->capacity) {
-    size_t new_capacity = hm->capacity == 0 ? 64 : hm->capacity * 1.62;
-    // we need to rehash
-    KHashMapEntry *new_items = tgc_calloc(&gc, new_capacity, sizeof(KHashMapEntry));
-    if (!new_items) {
-      fprintf(stderr, "Out of memory for hashmap\n");
-      exit(1);
-    }
-    KHashMapEntry *old_items = hm->items;
-    size_t old_size = hm->size;
+/* Hashmaps use Robin Hood hashing: an entry being inserted takes the slot
+ * of any entry that is closer to its home slot, so probe sequences stay
+ * short even at high load and lookups can stop as soon as they see an
+ * entry closer to home than the key would be. Deletion shifts the
+ * following entries back, so no tombstones are needed.
+ */
+#define HM_MIN_CAPACITY 16
 
-    hm->capacity = new_capacity;
-    hm->items = new_items;
-    hm->size = 0;
+/* Grow when more than 7/8 full */
+bool hm_full(KHashMap *hm) { return (hm->size + 1) * 8 > hm->capacity * 7; }
 
-    for (size_t i = 0; i < old_size; i++) {
-      hm_put(hm, old_items[i].key, old_items[i].value);
-    }
-    if(old_items) tgc_free(&gc, old_items);
-  }
-  idx = hash % hm->capacity;
-  size_t orig_idx = idx;
-  while(hm->items[idx].used && !kval_eq(key, hm->items[idx].key)) {
-    idx = (idx + 1) % hm->capacity;
-    if (idx == orig_idx) {
-      fprintf(stderr, "hm_put failed, no free space anywhere in table!\n");
+void hm_insert(KHashMap *hm, KHashMapEntry e) {
+  size_t mask = hm->capacity - 1;
+  size_t idx = e.hash & mask;
+  e.dist = 1;
+  for (;;) {
+    KHashMapEntry *at = &hm->items[idx];
+    if (!at->dist) {
+      *at = e;
       return;
     }
+    if (at->dist < e.dist) {
+      KHashMapEntry tmp = *at;
+      *at = e;
+      e = tmp;
+    }
+    idx = (idx + 1) & mask;
+    e.dist++;
+  }
+}
+
+void hm_resize(KHashMap *hm, size_t new_capacity) {
+  KHashMapEntry *old_items = hm->items;
+  size_t old_capacity = hm->capacity;
+  hm->items = alloc_node(new_capacity * sizeof(KHashMapEntry));
+  if (!hm->items) {
+    fprintf(stderr, "Out of memory for hashmap\n");
+    exit(1);
+  }
+  hm->capacity = new_capacity;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old_items[i].dist)
+      hm_insert(hm, old_items[i]);
+  }
+  if (old_items)
+    alloc_free(old_items);
+}
+
+KHashMapEntry *hm_find(KHashMap *hm, KVal key, uint32_t hash) {
+  if (hm->size == 0)
+    return NULL;
+  size_t mask = hm->capacity - 1;
+  size_t idx = hash & mask;
+  for (uint32_t dist = 1;; dist++) {
+    KHashMapEntry *at = &hm->items[idx];
+    if (at->dist < dist)
+      return NULL; // key would have displaced this entry
+    if (at->hash == hash && kval_eq(key, at->key))
+      return at;
+    idx = (idx + 1) & mask;
+  }
+}
+
+void hm_put(KHashMap *hm, KVal key, KVal value) {
+  uint32_t hash = kval_hash(key);
+  KHashMapEntry *e = hm_find(hm, key, hash);
+  hm->hash = 0;
+  if (e) {
+    gc_write(hm->items);
+    e->value = value;
+    return;
   }
-  hm->items[idx] = (KHashMapEntry){.key = key, .value = value, .used = true};
+  if (hm_full(hm))
+    hm_resize(hm, hm->capacity ? hm->capacity * 2 : HM_MIN_CAPACITY);
+  gc_write(hm);
+  gc_write(hm->items);
+  hm_insert(hm, (KHashMapEntry){.key = key, .value = value, .hash = hash});
   hm->size++;
 }
 
 KVal hm_get(KHashMap *hm, KVal key) {
-  uint32_t hash = kval_hash(key);
-  size_t idx = hash % hm->capacity;
-  size_t orig_idx = idx;
-  //printf("\n----%d search for: ", key.type); kval_dump(key); printf("- hash: %d, idx: %zu----\n", hash, idx);
-  while (hm->items[idx].used) {
-    /*printf("eq? ");
-    kval_dump(key);
-    printf(" vs: ");
-    kval_dump(hm->items[idx].key);
-    printf(" ? %s\n", kval_eq(key, hm->items[idx].key) ? "true" : "false");
-    */
-    if (kval_eq(key, hm->items[idx].key))
-      return hm->items[idx].value;
-    idx = (idx + 1) % hm->capacity;
-    if(idx == orig_idx) break; // gone through whole table
-  }
-  return (KVal){.type=KT_NIL};
-}
-
-KCtx *kctx_new() {
-  KCtx *ctx = tgc_calloc(&gc, 1, sizeof(KCtx));
-  ctx->names = tgc_calloc(&gc, 1, sizeof(KHashMap));
-  ctx->stack = tgc_calloc(&gc, 1, sizeof(KArray));
+  KHashMapEntry *e = hm_find(hm, key, kval_hash(key));
+  return e ? e->value : (KVal){.type = KT_NIL};
+}
+
+bool hm_del(KHashMap *hm, KVal key) {
+  KHashMapEntry *e = hm_find(hm, key, kval_hash(key));
+  if (!e)
+    return false;
+  hm->hash = 0;
+  gc_write(hm->items);
+  size_t mask = hm->capacity - 1;
+  size_t idx = e - hm->items;
+  for (;;) {
+    KHashMapEntry *next = &hm->items[(idx + 1) & mask];
+    if (next->dist <= 1)
+      break;
+    hm->items[idx] = *next;
+    hm->items[idx].dist--;
+    idx = (idx + 1) & mask;
+  }
+  hm->items[idx] = (KHashMapEntry){0};
+  hm->size--;
+  return true;
+}
+
+bool hm_eq(KHashMap *a, KHashMap *b) {
+  if (a->size != b->size)
+    return false;
+  for (size_t i = 0; i < a->capacity; i++) {
+    KHashMapEntry *e = &a->items[i];
+    if (e->dist) {
+      KHashMapEntry *o = hm_find(b, e->key, e->hash);
+      if (!o || !kval_eq(e->value, o->value))
+        return false;
+    }
+  }
+  return true;
+}
+
+/* Get the symbol for name, adding it if this is the first time the name
+ * is seen. The name is copied, so it can point into the source.
+ */
+KSymbol *intern(KCtx *ctx, const char *name, size_t len) {
+  KVal key = {.type = KT_STRING,
+              .data.string = {.len = len, .data = (char *)name}};
+  uint32_t hash = hash_str(key.data.string);
+  LOCK(heap->dict_lock);
+  KHashMapEntry *e = hm_find(ctx->symbols, key, hash);
+  KSymbol *sym;
+  if (e) {
+    sym = e->value.data.symbol;
+  } else {
+    sym = alloc_node(sizeof(KSymbol));
+    sym->hash = hash;
+    sym->name = (KString){.len = len, .data = alloc_leaf(len)};
+    memcpy(sym->name.data, name, len);
+    key.data.string = sym->name;
+    hm_put(ctx->symbols, key, (KVal){.type = KT_NAME, .data.symbol = sym});
+  }
+  UNLOCK(heap->dict_lock);
+  return sym;
+}
+
+#define KOKOKI_OUT_SIZE (64 * 1024) // output buffered by an instance
+
+KCtx *kctx_new(size_t stack_size) {
+  // nothing on the stack points to ctx between calls to the instance
+  KCtx *ctx = tgc_calloc_opt(&heap->gc, 1, sizeof(KCtx), TGC_ROOT, NULL);
+  ctx->heap = heap;
+  ctx->names = alloc_node(sizeof(KHashMap));
+  ctx->symbols = alloc_node(sizeof(KHashMap));
+  ctx->modules = alloc_node(sizeof(KHashMap));
+  ctx->stack = alloc_node(sizeof(KStack));
+  ctx->stack->capacity = stack_size ? stack_size : KOKOKI_STACK_SIZE;
+  ctx->stack->items = alloc_vals(ctx->stack->capacity);
+  ctx->out.buf = malloc(KOKOKI_OUT_SIZE);
+  ctx->out.capacity = ctx->out.buf ? KOKOKI_OUT_SIZE : 0;
+  struct termios t; // only terminals have attributes
+  ctx->out.lines = tcgetattr(fileno(stdout), &t) == 0;
   return ctx;
 }
 
@@ -248,17 +785,17 @@ void skipws(char **at) {
       c = **at;
     }
     if (c == '#') {
-      while (c != '\n') {
+      while (c != '\n' && c != 0) {
         next(at);
         c = **at;
       }
       goto start;
     } else if (c == '(') {
-      while (c != ')') {
+      while (c != ')' && c != 0) {
         next(at);
         c = **at;
       }
-      next(at);
+      if (c) next(at);
       goto start;
     }
   }
@@ -276,7 +813,7 @@ bool is_alphanumeric(char ch) { return is_alpha(ch) || is_digit(ch); }
 bool is_name_start_char(char ch) {
   return is_alpha(ch) || ch == '_' || ch == '$' || ch == '+' || ch == '<' ||
          ch == '>' || ch == '=' || ch == '?' || ch == '.' || ch == '*' ||
-         ch == '%' || ch == '!' ;
+         ch == '%' || ch == '!' || ch == '/';
 }
 
 bool is_name_char(char ch) {
@@ -295,97 +832,285 @@ bool looking_at(char *at, char *word) {
   return true;
 }
 
+/* Collected header of a mapped file, unmaps it when collected */
+typedef struct KMapping {
+  void *addr;
+  size_t len;
+} KMapping;
+
+KString kval_str(const KVal *v) {
+  if (v->small)
+    return (KString){.len = v->small - 1, .data = (char *)v->data.chars};
+  if (v->slice) {
+    KSlice s = v->data.slice;
+    char *buf = v->slice == KS_MAPPED ? ((KMapping *)s.base)->addr : s.base;
+    return (KString){.len = s.len, .data = buf + s.offset};
+  }
+  return v->data.string;
+}
+
+/* Make v a new string of len bytes and return where to write it. Small
+ * strings go in v itself, so the pointer is only good while v is.
+ */
+char *str_alloc(KVal *v, size_t len) {
+  if (len <= KOKOKI_SMALL_STRING) {
+    *v = (KVal){.type = KT_STRING, .small = (uint8_t)(len + 1)};
+    return v->data.chars;
+  }
+  *v = (KVal){.type = KT_STRING,
+              .data.string = {.len = len, .data = alloc_leaf(len)}};
+  COUNT_ALLOC(KA_STRING);
+  return v->data.string.data;
+}
+
+KVal copy_str(KType type, char *start, char *end);
+
+/* Slice of string v that shares its buffer. Short slices are copied
+ * inline, as are the rare ones that don't fit the 32 bit length or
+ * offset of a KSlice.
+ */
+KVal str_slice(const KVal *v, size_t start, size_t end) {
+  KString s = kval_str(v);
+  size_t len = end - start, offset = start;
+  KVal slice = {.type = KT_STRING, .slice = KS_BUFFER};
+  slice.data.slice.base = s.data;
+  if (v->slice) {
+    slice.slice = v->slice;
+    slice.data.slice.base = v->data.slice.base;
+    offset += v->data.slice.offset;
+  }
+  if (len <= KOKOKI_SMALL_STRING || len > UINT32_MAX || offset > UINT32_MAX)
+    return copy_str(KT_STRING, s.data + start, s.data + end);
+  slice.data.slice.len = (uint32_t)len;
+  slice.data.slice.offset = (uint32_t)offset;
+  return slice;
+}
+
+/* String value of s, short strings are copied inline */
+KVal str_val(KString s) {
+  if (s.len <= KOKOKI_SMALL_STRING) {
+    KVal v;
+    char *data = str_alloc(&v, s.len);
+    if (s.len)
+      memcpy(data, s.data, s.len);
+    return v;
+  }
+  return (KVal){.type = KT_STRING, .data.string = s};
+}
+
 KVal copy_str(KType type, char *start, char *end) {
   size_t len = (size_t)(end - start);
-  KVal s = (KVal){.type = type,
-                  .data.string = {.len = len, .data = tgc_alloc(&gc, len)}};
-  memcpy(s.data.string.data, start, len);
+  KVal s;
+  memcpy(str_alloc(&s, len), start, len);
+  s.type = type;
   return s;
 }
 
 KVal read_str(char **at) {
   char *start = *at + 1;
   char *end = start;
-  while (*end != '"') end++;
-  *at = end + 1;
+  while (*end && *end != '"') end++;
+  *at = *end ? end + 1 : end;
   return copy_str(KT_STRING, start, end);
 }
 
-KVal read_name(char **at) {
+KVal read_name(KCtx *ctx, char **at) {
   char *start = *at;
   char *end = start;
   while (is_name_char(*end)) end++;
   *at = end;
-  return copy_str(KT_NAME, start, end);
+  return (KVal){.type = KT_NAME,
+                .data.symbol = intern(ctx, start, (size_t)(end - start))};
 }
 
-KVal read_ref(char **at) {
+KVal read_ref(KCtx *ctx, char **at) {
   char *start = *at + 1;
   char *end = start;
   while (is_name_char(*end))
     end++;
   *at = end;
-  return copy_str(KT_REF_NAME, start, end);
+  return (KVal){.type = KT_REF_NAME,
+                .data.symbol = intern(ctx, start, (size_t)(end - start))};
 }
 
+/* Digits that fit in 53 bits with at most 22 decimals are exact doubles,
+ * as is the power of ten, so one division rounds them correctly. Other
+ * numbers are left to strtod.
+ */
 KVal read_num(char **at) {
-  double mult = 1.0;
-  double val = 0;
-  if (**at == '-') {
-    mult = -1.0;
+  static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                 1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                 1e18, 1e19, 1e20, 1e21, 1e22};
+  char *start = *at;
+  bool neg = **at == '-';
+  uint64_t digits = 0;
+  int scale = 0; // digits after the point
+  bool exact = true, fraction = false;
+  if (neg)
     *at = *at + 1;
-  }
-  while (is_digit(**at)) {
-    val = 10 * val + (**at - 48);
+  for (;;) {
+    if (**at == '.' && !fraction) {
+      fraction = true;
+    } else if (is_digit(**at)) {
+      int d = **at - '0';
+      if (digits > (UINT64_MAX - d) / 10) {
+        exact = false; // too many digits
+      } else {
+        digits = 10 * digits + d;
+        scale += fraction;
+      }
+    } else {
+      break;
+    }
     *at = *at + 1;
   }
-  if (**at == '.') {
-    // has fraction
-    *at = *at + 1;
-    double frac = 0, div = 1;
-    while (is_digit(**at)) {
-      frac = 10 * frac + (**at - 48);
-      div *= 10;
-      *at = *at + 1;
+  if (!fraction && exact && digits <= INT64_MAX)
+    return int_val(neg ? -(int64_t)digits : (int64_t)digits);
+  double val;
+  if (exact && digits <= (UINT64_C(1) << 53) && scale < 23) {
+    val = (double)digits / pow10[scale];
+    if (neg)
+      val = -val;
+  } else {
+    size_t len = *at - start;
+    char buf[64], *num = len < sizeof(buf) ? buf : malloc(len + 1);
+    if (!num) {
+      fprintf(stderr, "Out of memory");
+      exit(1);
     }
-    val += (frac / div);
+    memcpy(num, start, len);
+    num[len] = 0;
+    val = strtod(num, NULL);
+    if (num != buf)
+      free(num);
+  }
+  return (KVal){.type = KT_NUMBER, .data.number = val};
+}
+
+KVal read(KCtx *ctx, char **at);
+
+void arr_move(KArray *arr, size_t total, size_t front);
+
+/* Write barrier before storing to the items of arr, items shared with a
+ * copy are copied first.
+ */
+void arr_write(KArray *arr) {
+  if (arr->shared)
+    arr_move(arr, arr->size, 0);
+  gc_write(arr);
+  gc_write(arr->base);
+}
+
+/* Forget compiled code, hash and resolved names when an array is changed */
+void arr_modified(KArray *arr) {
+  arr->code = NULL;
+  arr->hash = 0;
+  arr->resolved = false;
+  arr_write(arr);
+}
+
+/* New empty array with room for capacity items after the header */
+KArray *arr_new(size_t capacity) {
+  KArray *arr = alloc_node(sizeof(KArray) + capacity * sizeof(KVal));
+  COUNT_ALLOC(KA_ARRAY);
+  if (!arr) {
+    fprintf(stderr, "Out of memory");
+    exit(1);
   }
-  return (KVal){.type = KT_NUMBER, .data.number = mult*val};
+  arr->items = arr->base = arr->inline_items;
+  arr->capacity = capacity;
+  return arr;
 }
 
-KVal read(char **at);
+/* Move items to a buffer of total items with front free slots before
+ * them. Inline and shared items can't be resized, so they are copied out.
+ */
+void arr_move(KArray *arr, size_t total, size_t front) {
+  KVal *base;
+  if (total == 0) {
+    arr->items = arr->base = arr->inline_items;
+    arr->capacity = 0;
+    arr->shared = NULL;
+    return;
+  }
+  if (arr->base == arr->inline_items || arr->shared) {
+    arr->shared = NULL;
+    base = alloc_vals(total);
+    if (base && arr->size)
+      memcpy(base + front, arr->items, arr->size * sizeof(KVal));
+  } else {
+    size_t old_front = arr->items - arr->base;
+    base = realloc_vals(arr->base, total);
+    if (base && arr->size)
+      memmove(base + front, base + old_front, arr->size * sizeof(KVal));
+  }
+  if (!base) {
+    fprintf(stderr, "Out of memory");
+    exit(1);
+  }
+  arr->base = base;
+  arr->items = base + front;
+  arr->capacity = total - front;
+}
 
 void arr_push(KArray *arr, KVal v) {
-  if (arr->size == arr->capacity) {
-    size_t new_capacity = arr->capacity == 0 ? 8 : arr->capacity * 1.62;
-    arr->items = tgc_realloc(&gc, arr->items, new_capacity * sizeof(KVal));
-    arr->capacity = new_capacity;
-    if (!arr->items) {
-      fprintf(stderr, "Out of memory");
-      exit(1);
+  if (arr->shared) {
+    arr_move(arr, arr->size == 0 ? 8 : arr->size * 1.62 + 1, 0);
+  } else if (arr->size == arr->capacity) {
+    size_t front = arr->items - arr->base;
+    size_t total = front + arr->capacity;
+    if (front && front >= total / 2) {
+      // mostly free at the front after shifts, slide items back
+      memmove(arr->base, arr->items, arr->size * sizeof(KVal));
+      arr->items = arr->base;
+      arr->capacity = total;
+    } else {
+      arr_move(arr, total == 0 ? 8 : total * 1.62 + 1, 0);
     }
   }
-  //printf("arr->size before push: %zu\n", arr->size);
+  arr_modified(arr);
   arr->items[arr->size++] = v;
-  //printf("arr->size after push: %zu\n", arr->size);
 }
 
-void arr_remove_first(KArray *arr) {
-  if (arr->size == 1) {
-    arr->size = 0;
-  } else {
-    for (int i = 0; i < arr->size - 1; i++) {
-      arr->items[i] = arr->items[i+1];
-    }
-    arr->size -= 1;
+/* Add item to the front, free room is kept at both ends when the items
+ * need to be moved, so pushing to either end is amortized O(1).
+ */
+void arr_unshift(KArray *arr, KVal v) {
+  if (arr->items == arr->base || arr->shared) {
+    size_t total = arr->capacity == 0 ? 8 : arr->capacity * 1.62 + 1;
+    arr_move(arr, total, (total - arr->size + 1) / 2);
   }
+  arr_modified(arr);
+  arr->items--;
+  arr->capacity++;
+  arr->size++;
+  arr->items[0] = v;
 }
+
+/* Remove and return first item, call with a non empty array */
+KVal arr_shift(KArray *arr) {
+  KVal item = arr->items[0];
+  arr_modified(arr);
+  arr->items[0] = (KVal){.type = KT_NIL}; // don't keep it alive
+  arr->items++;
+  arr->capacity--;
+  arr->size--;
+  return item;
+}
+
+/* Remove item at idx, moving the shorter side of the array over it */
 KVal arr_remove_nth(KArray *arr, size_t idx) {
   KVal item = arr->items[idx];
-  for (size_t i = idx; i < arr->size - 1; i++) {
-    arr->items[i] = arr->items[i+1];
+  arr_modified(arr);
+  if (idx < arr->size / 2) {
+    memmove(arr->items + 1, arr->items, idx * sizeof(KVal));
+    arr_shift(arr);
+  } else {
+    memmove(arr->items + idx, arr->items + idx + 1,
+            (arr->size - idx - 1) * sizeof(KVal));
+    arr->size--;
   }
-  arr->size -= 1;
   return item;
 }
 
@@ -403,6 +1128,7 @@ bool check_underflow(KArray *arr, KVal *val) {
 KVal arr_pop(KArray *arr) {
   KVal ret;
   if (check_underflow(arr, &ret)) {
+    arr_modified(arr);
     ret = arr->items[--arr->size];
   }
   return ret;
@@ -416,23 +1142,148 @@ KVal arr_peek(KArray *arr) {
   return ret;
 }
 
+/* Data stack */
+KVal stack_underflow() {
+  return (KVal){.type = KT_ERROR,
+                .data.string = {.len = strlen(ERR_STACK_UNDERFLOW),
+                                .data = (char *)ERR_STACK_UNDERFLOW}};
+}
+
+/* Make room for n more items, only needed when the stack goes deeper
+ * than it has before.
+ */
+void stack_grow(KStack *s, size_t n) {
+  size_t capacity = s->capacity ? s->capacity : KOKOKI_STACK_SIZE;
+  while (capacity < s->size + n)
+    capacity *= 2;
+  s->items = realloc_vals(s->items, capacity);
+  if (!s->items) {
+    fprintf(stderr, "Out of memory");
+    exit(1);
+  }
+  s->capacity = capacity;
+}
+
+void stack_push(KStack *s, KVal v) {
+  if (s->size == s->capacity)
+    stack_grow(s, 1);
+  s->items[s->size++] = v;
+}
+
+KVal stack_pop(KStack *s) {
+  return s->size ? s->items[--s->size] : stack_underflow();
+}
+
+void kokoki_push(KCtx *ctx, KVal v) {
+  ENTER(ctx);
+  stack_push(ctx->stack, v);
+  LEAVE();
+}
+
+KVal kokoki_pop(KCtx *ctx) {
+  ENTER(ctx);
+  KVal v = stack_pop(ctx->stack);
+  LEAVE();
+  return v;
+}
+
+/* Call native after checking the stack has the items it takes and room
+ * for the items it leaves.
+ */
+void call_native(KCtx *ctx, const KNative *n) {
+  KStack *s = ctx->stack;
+  if (s->size < n->in) {
+    stack_push(s, stack_underflow());
+    return;
+  }
+  if (s->capacity - s->size < n->out)
+    stack_grow(s, n->out);
+  n->fn(ctx);
+}
+
+/* Execute v as the last thing a native does. Natives are called by exec
+ * and run, which execute v once the native has returned, so words that
+ * recurse through cond or exec don't nest C calls. Only natives called
+ * with call_native may use this.
+ */
+void exec_tail(KCtx *ctx, KVal v) {
+  if (v.type == KT_NIL) // nil marks that there is no tail
+    stack_push(ctx->stack, v);
+  else
+    ctx->tail = v;
+}
+
+/* Value left with exec_tail by the native that just returned */
+KVal take_tail(KCtx *ctx) {
+  KVal v = ctx->tail;
+  ctx->tail.type = KT_NIL;
+  return v;
+}
+
 
-KVal read_array_(char **at, char endch) {
-  KArray *arr = tgc_calloc(&gc, 1, sizeof(KArray));
+KVal read_array_(KCtx *ctx, char **at, char endch) {
+  KArray *tmp = alloc_node(sizeof(KArray));
   *at = *at + 1;
   while (**at != endch) {
-    KVal v = read(at);
-    arr_push(arr, v);
+    KVal v = read(ctx, at);
+    if (v.type == KT_EOF) {
+      alloc_free(tmp->base);
+      alloc_free(tmp);
+      err(v, "Expected '%c' before end of input", endch);
+      return v;
+    }
+    arr_push(tmp, v);
     skipws(at);
   }
   *at = *at + 1;
+  // the size is known now, keep the items next to the header
+  KArray *arr = arr_new(tmp->size);
+  if (tmp->size)
+    memcpy(arr->items, tmp->items, tmp->size * sizeof(KVal));
+  arr->size = tmp->size;
+  alloc_free(tmp->base);
+  alloc_free(tmp);
   return (KVal){.type = KT_ARRAY, .data.array = arr};
 }
 
-KVal read_array(char **at) { return read_array_(at, ']'); }
+KVal read_array(KCtx *ctx, char **at) {
+  return read_array_(ctx, at, ']');
+}
+
+KVal read_hashmap(KCtx *ctx, char **at) {
+  COUNT_ALLOC(KA_HASHMAP);
+  KVal hm = (KVal){.type = KT_HASHMAP,
+                   .data.hashmap = alloc_node(sizeof(KHashMap))};
+  *at = *at + 1;
+  skipws(at);
+  while (**at && **at != '}') {
+    KVal key = read(ctx, at);
+    if (key.type == KT_ERROR)
+      return key;
+    skipws(at);
+    if (**at == '}' || !**at) {
+      err(hm, "Expected key/value pairs in hashmap");
+      break;
+    }
+    KVal value = read(ctx, at);
+    if (value.type == KT_ERROR)
+      return value;
+    hm_put(hm.data.hashmap, key, value);
+    skipws(at);
+  }
+  if (!**at) {
+    if (hm.type != KT_ERROR)
+      err(hm, "Expected '}' before end of input");
+    return hm;
+  }
+  *at = *at + 1;
+  return hm;
+}
 
-KVal read_definition(char **at) {
-  KVal def = read_array_(at, ';');
+KVal read_definition(KCtx *ctx, char **at) {
+  KVal def = read_array_(ctx, at, ';');
+  if (def.type == KT_ERROR)
+    return def;
   def.type = KT_DEFINITION;
   if (def.data.array->size < 2) {
     err(def, "Expected name and at least one token in definition");
@@ -443,20 +1294,20 @@ KVal read_definition(char **at) {
 }
 
 
-KVal read(char **at) {
+KVal read(KCtx *ctx, char **at) {
   skipws(at);
   switch (**at) {
   case 0:
     return (KVal){.type = KT_EOF};
   case '@':
-    return read_ref(at);
+    return read_ref(ctx, at);
   case '"':
     return read_str(at);
   case '0': case '1': case '2': case '3': case '4': case '5':
   case '6': case '7': case '8': case '9':
     if (is_alpha(*(*at + 1))) {
       // to support names like "2dup" that start with number
-      return read_name(at);
+      return read_name(ctx, at);
     } else {
       return read_num(at);
     }
@@ -464,7 +1315,7 @@ KVal read(char **at) {
     if (is_digit(*(*at + 1))) {
       return read_num(at);
     } else {
-      return read_name(at);
+      return read_name(ctx, at);
     }
 
   case '\'': {
@@ -472,192 +1323,1273 @@ KVal read(char **at) {
       goto fail;
     char ch = *(*at + 1);
     *at += 3;
-    return (KVal){.type = KT_NUMBER, .data.number = ch};
+    return int_val(ch);
   }
   case 't': {
     if (looking_at(*at, "true")) {
       *at = *at + 4;
       return (KVal){.type = KT_TRUE};
     }
-    return read_name(at);
+    return read_name(ctx, at);
   }
   case 'f': {
     if (looking_at(*at, "false")) {
       *at = *at + 5;
       return (KVal){.type = KT_FALSE};
     }
-    return read_name(at);
+    return read_name(ctx, at);
   }
   case 'n': {
     if (looking_at(*at, "nil")) {
       *at = *at + 3;
       return (KVal){.type = KT_NIL};
     }
-    return read_name(at);
+    return read_name(ctx, at);
   }
   case ':':
-    return read_definition(at);
+    return read_definition(ctx, at);
   case '[':
-    return read_array(at);
+    return read_array(ctx, at);
+  case '{':
+    return read_hashmap(ctx, at);
   default:
     if (is_name_start_char(**at)) {
-      return read_name(at);
+      return read_name(ctx, at);
     }
   }
  fail: {
   int err_len = snprintf(NULL, 0, "Parse error at: '%c'     ", **at);
-  char *err = tgc_alloc(&gc, err_len);
+  char *err = alloc_leaf(err_len);
+  COUNT_ALLOC(KA_ERROR);
   snprintf(err, err_len, "Parse error at: '%c'", **at);
   *at = *at + 1;
   return (KVal){.type = KT_ERROR, .data.string = {.len = err_len - 1, err}};
   }
 }
 
-void kval_dump(KVal v) {
-  switch (v.type) {
-  case KT_NIL:
-    col(PURPLE);
-    printf("nil");
-    break;
-  case KT_TRUE:
-    col(RED);
-    printf("true");
-    break;
-  case KT_FALSE:
-    col(RED);
-    printf("false");
-    break;
-  case KT_STRING:
-    col(GREEN);
-    printf("%.*s", (int) v.data.string.len, v.data.string.data);
-    break;
-  case KT_NAME:
-    printf("%.*s", (int)v.data.string.len, v.data.string.data);
-    break;
-  case KT_REF_NAME:
-    printf("@%.*s", (int)v.data.string.len, v.data.string.data);
-    break;
+/* Output */
+
+void out_flush(KOut *o) {
+  if (o->len)
+    fwrite(o->buf, 1, o->len, stdout);
+  o->len = 0;
+}
+
+void out_write(KOut *o, const char *s, size_t n) {
+  if (o->len + n > o->capacity) {
+    out_flush(o);
+    if (n > o->capacity) { // too big to buffer
+      fwrite(s, 1, n, stdout);
+      return;
+    }
+  }
+  memcpy(o->buf + o->len, s, n);
+  o->len += n;
+}
+
+void out_str(KOut *o, const char *s) { out_write(o, s, strlen(s)); }
+
+void out_printf(KOut *o, const char *fmt, ...) {
+  char buf[128];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  out_write(o, buf, n < (int)sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+/* Write decimal digits of i to buf, returns the length */
+size_t fmt_int(char *buf, int64_t i) {
+  char digits[20];
+  uint64_t u = i < 0 ? -(uint64_t)i : (uint64_t)i;
+  size_t n = 0, len = 0;
+  do {
+    digits[n++] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (i < 0)
+    buf[len++] = '-';
+  while (n)
+    buf[len++] = digits[--n];
+  return len;
+}
+
+#ifdef __SIZEOF_INT128__
+/* Shortest digits reading back as positive d = 2m / 2^s. Its rounding
+ * interval is (2m - 1, 2m + 1) / 2^s, scaled by 10^k for k decimals, and
+ * the first k that has an integer in it gives the digits. The ends are
+ * exact in 128 bits for 0 < s <= 64, otherwise 0 is returned.
+ */
+size_t fmt_fraction(char *buf, double d) {
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  int be = (bits >> 52) & 0x7ff, s = 1076 - be;
+  uint64_t m = bits & ((UINT64_C(1) << 52) - 1);
+  if (m == 0 || be == 0 || s < 1 || s > 64)
+    return 0; // powers of two have an uneven interval, subnormals none
+  m |= UINT64_C(1) << 52;
+  bool even = !(m & 1); // ends of the interval round to even m
+  unsigned __int128 p = 1, mask = ((unsigned __int128)1 << s) - 1;
+  for (int k = 0; k <= 20; k++, p *= 10) {
+    unsigned __int128 lo = (2 * m - 1) * p, hi = (2 * m + 1) * p;
+    unsigned __int128 q_lo = (lo >> s) + !(even && !(lo & mask));
+    unsigned __int128 q_hi = even && !(hi & mask) ? hi >> s : (hi - 1) >> s;
+    if (q_lo > q_hi)
+      continue;
+    unsigned __int128 q = (2 * m * p + (mask >> 1) + 1) >> s; // nearest
+    q = q < q_lo ? q_lo : q > q_hi ? q_hi : q;
+    char digits[24];
+    size_t n = 0, len = 0;
+    for (; q || n <= (size_t)k; q /= 10)
+      digits[n++] = '0' + q % 10;
+    while (n) {
+      if (n-- == (size_t)k)
+        buf[len++] = '.';
+      buf[len++] = digits[n];
+    }
+    return len;
+  }
+  return 0;
+}
+#endif
+
+/* Shortest text that reads back as d, whole numbers are written without
+ * a fraction. Numbers the exact method doesn't cover are tried with more
+ * digits until they read back.
+ */
+size_t fmt_number(char *buf, double d) {
+  if (d > -9.2e18 && d < 9.2e18 && d == (int64_t)d)
+    return fmt_int(buf, (int64_t)d);
+#ifdef __SIZEOF_INT128__
+  size_t len = d < 0 ? fmt_fraction(buf + 1, -d) : fmt_fraction(buf, d);
+  if (len && d < 0)
+    buf[0] = '-';
+  if (len)
+    return len + (d < 0);
+#endif
+  int n = 0;
+  for (int digits = 15; digits <= 17; digits++) {
+    n = snprintf(buf, 32, "%.*g", digits, d);
+    if (strtod(buf, NULL) == d || d != d)
+      break;
+  }
+  return n;
+}
+
+void kval_write(KOut *o, KVal v) {
+  char num[32];
+  switch (v.type) {
+  case KT_NIL:
+    out_str(o, colors[PURPLE]);
+    out_str(o, "nil");
+    break;
+  case KT_TRUE:
+    out_str(o, colors[RED]);
+    out_str(o, "true");
+    break;
+  case KT_FALSE:
+    out_str(o, colors[RED]);
+    out_str(o, "false");
+    break;
+  case KT_STRING: {
+    KString s = kval_str(&v);
+    out_str(o, colors[GREEN]);
+    out_write(o, s.data, s.len);
+    break;
+  }
+  case KT_NAME:
+    out_write(o, v.data.symbol->name.data, v.data.symbol->name.len);
+    break;
+  case KT_WORD:
+    out_write(o, v.data.word->name.data, v.data.word->name.len);
+    break;
+  case KT_REF_NAME:
+    out_str(o, "@");
+    out_write(o, v.data.symbol->name.data, v.data.symbol->name.len);
+    break;
   case KT_REF_VALUE:
-    printf("#<Ref: ");
-    kval_dump(v.data.ref->value);
-    printf(">");
+    out_str(o, "#<Ref: ");
+    kval_write(o, v.data.ref->value);
+    out_str(o, ">");
+    break;
+  case KT_FILE:
+    out_printf(o, "#<file %p>", (void *)v.data.file);
+    break;
+  case KT_SEQ:
+    out_printf(o, "#<seq %p>", (void *)v.data.seq);
+    break;
+  case KT_INT:
+    out_str(o, colors[YELLOW]);
+    out_write(o, num, fmt_int(num, v.data.integer));
     break;
   case KT_NUMBER:
-    col(YELLOW);
-    if ((v.data.number - (long)v.data.number) == 0.0) {
-      printf("%ld", (long)v.data.number);
-    } else {
-      printf("%f", v.data.number);
-    }
+    out_str(o, colors[YELLOW]);
+    out_write(o, num, fmt_number(num, v.data.number));
     break;
 
   case KT_ARRAY:
-    printf("[");
+    out_str(o, "[");
     for (size_t i = 0; i < v.data.array->size; i++) {
       if (i > 0)
-        printf(" ");
-      kval_dump(v.data.array->items[i]);
+        out_str(o, " ");
+      kval_write(o, v.data.array->items[i]);
+    }
+    out_str(o, "]");
+    break;
+
+  case KT_VECTOR:
+    out_str(o, v.data.vector->type == KT_INT ? "#ints[" : "#numbers[");
+    for (size_t i = 0; i < v.data.vector->size; i++) {
+      if (i > 0)
+        out_str(o, " ");
+      kval_write(o, vec_get(v.data.vector, i));
     }
-    printf("]");
+    out_str(o, "]");
     break;
 
   case KT_DEFINITION:
   case KT_BLOCK:
-    printf(v.type == KT_BLOCK ? "{" : ": ");
+    out_str(o, v.type == KT_BLOCK ? "{" : ": ");
     for (size_t i = 0; i < v.data.array->size; i++) {
       if (i > 0)
-        printf(" ");
-      kval_dump(v.data.array->items[i]);
+        out_str(o, " ");
+      kval_write(o, v.data.array->items[i]);
     }
-    printf(v.type == KT_BLOCK ? "}" : " ; ");
+    out_str(o, v.type == KT_BLOCK ? "}" : " ; ");
     break;
 
 
   case KT_NATIVE:
-    printf("#<native function %p>", v.data.native);
+    out_printf(o, "#<native function %p>", (void *)v.data.native);
     break;
-  case KT_HASHMAP:
-    printf("#<hashmap fixme>");
+  case KT_HASHMAP: {
+    bool first = true;
+    out_str(o, "{");
+    for (size_t i = 0; i < v.data.hashmap->capacity; i++) {
+      KHashMapEntry *e = &v.data.hashmap->items[i];
+      if (!e->dist)
+        continue;
+      if (!first)
+        out_str(o, " ");
+      first = false;
+      kval_write(o, e->key);
+      out_str(o, " ");
+      kval_write(o, e->value);
+    }
+    out_str(o, "}");
     break;
-  case KT_ERROR:
-    printf("#<ERROR: %.*s>", (int)v.data.string.len, v.data.string.data);
+  }
+  case KT_ERROR: {
+    KString s = kval_str(&v);
+    out_str(o, "#<ERROR: ");
+    out_write(o, s.data, s.len);
+    out_str(o, ">");
     break;
+  }
   case KT_EOF:
-    printf("#<EOF>");
+    out_str(o, "#<EOF>");
     break;
   }
-  reset();
+  out_str(o, _reset);
+}
+
+void kval_dump(KVal v) {
+  char buf[256];
+  KOut o = {.buf = buf, .capacity = sizeof(buf)};
+  kval_write(&o, v);
+  out_flush(&o);
 }
 
 void debug_stack(KCtx *ctx) {
   for (size_t i = 0; i < ctx->stack->size; i++) {
-   printf(" ");
-   kval_dump(ctx->stack->items[i]);
+   out_str(&ctx->out, " ");
+   kval_write(&ctx->out, ctx->stack->items[i]);
   }
 }
 
 void debug_exec(KCtx *ctx, KVal v) {
-  printf("EXECUTING %d: ", v.type);
-  kval_dump(v);
-  printf(" STACK:");
+  out_printf(&ctx->out, "EXECUTING %d: ", v.type);
+  kval_write(&ctx->out, v);
+  out_str(&ctx->out, " STACK:");
   debug_stack(ctx);
-  printf("\n");
+  out_str(&ctx->out, "\n");
 }
 
-void exec(KCtx *ctx, KVal v) {
-  //debug_exec(ctx, v);
-  switch (v.type) {
-  case KT_NAME: {
-    KVal name = hm_get(ctx->names, v);
-    if (name.type == KT_NIL) {
-      fprintf(stderr, "Undefined name: %.*s\n", (int)v.data.string.len,
-              v.data.string.data);
-    } else {
-      exec(ctx, name);
+/* Get the dictionary entry for name, adding an undefined entry if there
+ * is none yet. Entries are never removed, so resolved words stay valid
+ * when the name is (re)defined later.
+ */
+KWord *word_entry(KCtx *ctx, KVal name) {
+  LOCK(heap->dict_lock);
+  KVal w = hm_get(ctx->names, name);
+  KWord *word;
+  if (w.type == KT_WORD) {
+    word = w.data.word;
+  } else {
+    word = alloc_node(sizeof(KWord));
+    word->value = (KVal){.type = KT_NIL};
+    word->name = name.data.symbol->name;
+    hm_put(ctx->names, name, (KVal){.type = KT_WORD, .data.word = word});
+  }
+  UNLOCK(heap->dict_lock);
+  return word;
+}
+
+/* Give word a new definition. Compiled code that has the old one built
+ * in is compiled again before it runs next.
+ */
+void word_define(KWord *word, KVal v) {
+  if (word->inlined)
+    __atomic_add_fetch(&heap->epoch, 1, __ATOMIC_RELAXED);
+  gc_write(word);
+  word->value = v;
+}
+
+/* Dictionary lookup, nil if name has no entry */
+KVal names_get(KCtx *ctx, KVal name) {
+  LOCK(heap->dict_lock);
+  KVal v = hm_get(ctx->names, name);
+  UNLOCK(heap->dict_lock);
+  return v;
+}
+
+void names_put(KCtx *ctx, KVal name, KVal v) {
+  LOCK(heap->dict_lock);
+  hm_put(ctx->names, name, v);
+  UNLOCK(heap->dict_lock);
+}
+
+/* Link pass: replace names in code (and nested arrays) with resolved
+ * words so executing them doesn't need a dictionary lookup. Arrays are
+ * walked once until they are modified, names left in nested arrays
+ * changed later are looked up when executed.
+ */
+void resolve(KCtx *ctx, KArray *code) {
+  if (code->resolved)
+    return;
+  for (size_t i = 0; i < code->size; i++) {
+    KVal *v = &code->items[i];
+    if (v->type == KT_NAME) {
+      KWord *word = word_entry(ctx, *v);
+      arr_modified(code);
+      code->items[i] = (KVal){.type = KT_WORD, .data.word = word};
+    } else if (v->type == KT_ARRAY) {
+      resolve(ctx, v->data.array);
     }
-    break;
   }
-  case KT_NATIVE: {
-    void(*fn)(KCtx *) = v.data.native;
-    fn(ctx);
-    break;
+  code->resolved = true;
+}
+
+/* Turn value given to a native as code into something executable */
+KVal code_block(KCtx *ctx, KVal code) {
+  if (code.type == KT_ARRAY) {
+    resolve(ctx, code.data.array);
+    code.type = KT_BLOCK;
+  }
+  return code;
+}
+
+/* Compiled code
+ *
+ * Blocks are compiled on first execution to a flat array of instructions
+ * run by the inner interpreter loop in run(). Calls from compiled code to
+ * compiled words go through the return stack in the context, so they
+ * don't use C stack. A call in tail position, with nothing but jumps
+ * between it and the return, replaces the caller's frame instead of
+ * pushing a new one, so words that recurse as their last step run in
+ * constant space. Blocks that can't be compiled (those containing
+ * definitions) are run item by item by exec, which likewise jumps to the
+ * last item instead of calling it.
+ *
+ * A literal array directly followed by cond is compiled inline as
+ * branches, if cond has its builtin definition at compile time.
+ * Likewise common sequences of builtin words are fused into single
+ * superinstructions (see compile_fused).
+ *
+ * Define KOKOKI_NO_COMPILE to always use exec.
+ */
+
+#define DO_OPS                                                                 \
+  DO(OP_PUSH)       /* push literal */                                         \
+  DO(OP_NATIVE)     /* call native function */                                 \
+  DO(OP_CALL)       /* call word through its dictionary entry */               \
+  DO(OP_TAIL)       /* call word as the last thing before returning */         \
+  DO(OP_EXEC)       /* execute literal with exec */                            \
+  DO(OP_JUMP)       /* continue at target */                                   \
+  DO(OP_JUMP_FALSE) /* pop value and continue at target if it is falsy */      \
+  DO(OP_ADDK)       /* N + */                                                  \
+  DO(OP_SUBK)       /* N - */                                                  \
+  DO(OP_PICK)       /* N pick */                                               \
+  DO(OP_MOVE)       /* N move */                                               \
+  DO(OP_MODZ)       /* N % 0 = */                                              \
+  DO(OP_DUP_MODZ)   /* dup N % 0 = */                                          \
+  DO(OP_RET)        /* return to caller */
+
+typedef enum KOp {
+#define DO(op) op,
+  DO_OPS
+#undef DO
+} KOp;
+
+typedef struct KInstr {
+  KOp op;
+  union {
+    KVal *lit;
+    const KNative *native;
+    KWord *word;
+    struct KInstr *target;
+    size_t idx; // literal or target index while compiling
+  } a;
+} KInstr;
+
+struct KCode {
+  size_t size;
+  KInstr *ops;
+  KVal *lits;
+  const KNative *leaf; // set if code only calls this native
+  uint64_t epoch; // heap epoch the code was compiled in
+};
+
+struct KFrame {
+  KCode *code; // keeps the code alive while it is running
+  KInstr *ip;
+};
+
+static KCode NOT_COMPILABLE;
+
+typedef struct KCompiler {
+  KCtx *ctx;
+  KInstr *ops;
+  size_t nops, ops_capacity;
+  KVal *lits;
+  size_t nlits, lits_capacity;
+} KCompiler;
+
+#if defined(__GNUC__) && !defined(KOKOKI_NO_THREADED)
+#define KOKOKI_THREADED
+#endif
+
+void exec(KCtx *ctx, KVal v);
+void native_cond(KCtx *ctx);
+void native_if(KCtx *ctx);
+void native_if_else(KCtx *ctx);
+void native_times(KCtx *ctx);
+void native_dup(KCtx *ctx);
+void native_drop(KCtx *ctx);
+void native_swap(KCtx *ctx);
+void native_rot(KCtx *ctx);
+void native_pick(KCtx *ctx);
+void native_move(KCtx *ctx);
+void native_plus(KCtx *ctx);
+void native_minus(KCtx *ctx);
+void native_mod(KCtx *ctx);
+void native_equals(KCtx *ctx);
+
+size_t emit(KCompiler *c, KOp op) {
+  if (c->nops == c->ops_capacity) {
+    c->ops_capacity = c->ops_capacity == 0 ? 16 : c->ops_capacity * 1.62;
+    c->ops = alloc_realloc(c->ops, c->ops_capacity * sizeof(KInstr));
+    if (!c->ops) {
+      fprintf(stderr, "Out of memory");
+      exit(1);
+    }
+  }
+  c->ops[c->nops].op = op;
+  return c->nops++;
+}
+
+void emit_lit(KCompiler *c, KOp op, KVal v) {
+  if (c->nlits == c->lits_capacity) {
+    c->lits_capacity = c->lits_capacity == 0 ? 8 : c->lits_capacity * 1.62;
+    c->lits = realloc_vals(c->lits, c->lits_capacity);
+    if (!c->lits) {
+      fprintf(stderr, "Out of memory");
+      exit(1);
+    }
   }
+  c->lits[c->nlits] = v;
+  size_t at = emit(c, op);
+  c->ops[at].a.idx = c->nlits++;
+}
+
+bool is_native(KVal v, void (*native)(KCtx *)) {
+  return v.type == KT_WORD && v.data.word->value.type == KT_NATIVE &&
+         v.data.word->value.data.native->fn == native;
+}
+
+/* is_native for a word the compiler builds into code instead of calling
+ * it. The word is marked, so redefining it compiles such code again.
+ */
+bool inlines(KVal v, void (*native)(KCtx *)) {
+  if (!is_native(v, native))
+    return false;
+  v.data.word->inlined = true;
+  return true;
+}
+
+bool compile_items(KCompiler *c, KArray *code);
+
+/* Compile value to do what exec would do with it */
+bool compile_item(KCompiler *c, KVal v) {
+  size_t at;
+  switch (v.type) {
+  case KT_NAME:
+    v = (KVal){.type = KT_WORD, .data.word = word_entry(c->ctx, v)};
+    // fallthrough
+  case KT_WORD:
+    at = emit(c, OP_CALL);
+    c->ops[at].a.word = v.data.word;
+    return true;
+  case KT_NATIVE:
+    at = emit(c, OP_NATIVE);
+    c->ops[at].a.native = v.data.native;
+    return true;
   case KT_NIL:
   case KT_TRUE:
   case KT_FALSE:
   case KT_NUMBER:
+  case KT_INT:
   case KT_STRING:
   case KT_ARRAY:
+  case KT_HASHMAP:
+  case KT_FILE:
+  case KT_VECTOR:
+  case KT_SEQ:
   case KT_REF_NAME:
-    arr_push(ctx->stack, v);
-    break;
+    emit_lit(c, OP_PUSH, v);
+    return true;
+  case KT_DEFINITION:
+    return false;
+  default:
+    emit_lit(c, OP_EXEC, v);
+    return true;
+  }
+}
 
-  case KT_DEFINITION: {
-    KVal name = v.data.array->items[0];
-    arr_remove_first(v.data.array);
-    v.type = KT_BLOCK;
-    hm_put(ctx->names, name, v);
-    //printf("defined name: ");
-    //kval_dump(name);
-    //printf("\n");
-    break;
+/* Compile condition or action of cond, arrays are run as blocks */
+bool compile_branch(KCompiler *c, KVal v) {
+  if (v.type == KT_ARRAY)
+    return compile_items(c, v.data.array);
+  return compile_item(c, v);
+}
+
+bool compile_cond(KCompiler *c, KArray *cond) {
+  size_t pairs = cond->size / 2;
+  KArenaMark mark = arena_mark(c->ctx);
+  size_t *ends = arena_alloc(c->ctx, sizeof(size_t) * pairs);
+  bool ok = true;
+  for (size_t i = 0; ok && i < pairs; i++) {
+    ok = compile_branch(c, cond->items[i * 2]);
+    size_t next = emit(c, OP_JUMP_FALSE);
+    ok = ok && compile_branch(c, cond->items[i * 2 + 1]);
+    ends[i] = emit(c, OP_JUMP);
+    c->ops[next].a.idx = c->nops;
   }
+  for (size_t i = 0; ok && i < pairs; i++)
+    c->ops[ends[i]].a.idx = c->nops;
+  arena_release(c->ctx, mark);
+  return ok;
+}
 
-  case KT_BLOCK: {
-    for (size_t i = 0; i < v.data.array->size; i++) {
-      exec(ctx, v.data.array->items[i]);
+/* [then] if and [then] [else] if-else with literal code */
+bool compile_if(KCompiler *c, KVal then, KVal *otherwise) {
+  size_t skip = emit(c, OP_JUMP_FALSE);
+  bool ok = compile_branch(c, then);
+  if (ok && otherwise) {
+    size_t end = emit(c, OP_JUMP);
+    c->ops[skip].a.idx = c->nops;
+    ok = compile_branch(c, *otherwise);
+    c->ops[end].a.idx = c->nops;
+  } else {
+    c->ops[skip].a.idx = c->nops;
+  }
+  return ok;
+}
+
+bool is_int(KVal v, int64_t min) {
+  return v.type == KT_INT && v.data.integer >= min;
+}
+
+bool is_zero(KVal v) { return v.type == KT_INT && v.data.integer == 0; }
+
+/* Superinstructions the compiler fuses stack idioms into. They work on
+ * the stack items in place.
+ */
+
+/* swap drop (a b -- b) */
+void super_nip(KCtx *ctx) {
+  KStack *s = ctx->stack;
+  s->items[s->size - 2] = s->items[s->size - 1];
+  s->size--;
+}
+
+/* swap dup rot swap (a b -- a b a) */
+void super_over(KCtx *ctx) {
+  KStack *s = ctx->stack;
+  s->items[s->size] = s->items[s->size - 2];
+  s->size++;
+}
+
+/* dup rot rot (a b -- b a b) */
+void super_tuck(KCtx *ctx) {
+  KStack *s = ctx->stack;
+  KVal b = s->items[s->size - 1];
+  s->items[s->size - 1] = s->items[s->size - 2];
+  s->items[s->size - 2] = b;
+  s->items[s->size++] = b;
+}
+
+/* rot rot (a b c -- c a b) */
+void super_rot2(KCtx *ctx) {
+  KStack *s = ctx->stack;
+  KVal *top = &s->items[s->size - 1];
+  KVal c = top[0];
+  top[0] = top[-1];
+  top[-1] = top[-2];
+  top[-2] = c;
+}
+
+/* drop drop (a b --) */
+void super_2drop(KCtx *ctx) {
+  KStack *s = ctx->stack;
+  s->size -= 2;
+}
+
+/* rot drop rot drop (a b c d -- c d) */
+void super_2nip(KCtx *ctx) {
+  KStack *s = ctx->stack;
+  KVal *top = &s->items[s->size - 1];
+  top[-3] = top[-1];
+  top[-2] = top[0];
+  s->size -= 2;
+}
+
+static const KNative SUPER_NIP = {super_nip, 2, 1};
+static const KNative SUPER_OVER = {super_over, 2, 3};
+static const KNative SUPER_TUCK = {super_tuck, 2, 3};
+static const KNative SUPER_ROT2 = {super_rot2, 3, 3};
+static const KNative SUPER_2DROP = {super_2drop, 2, 0};
+static const KNative SUPER_2NIP = {super_2nip, 4, 2};
+
+typedef struct KFusion {
+  size_t len;
+  void (*seq[4])(KCtx *);
+  const KNative *super;
+} KFusion;
+
+static const KFusion FUSIONS[] = {
+    {4, {native_swap, native_dup, native_rot, native_swap}, &SUPER_OVER},
+    {4, {native_rot, native_drop, native_rot, native_drop}, &SUPER_2NIP},
+    {3, {native_dup, native_rot, native_rot}, &SUPER_TUCK},
+    {2, {native_swap, native_drop}, &SUPER_NIP},
+    {2, {native_rot, native_rot}, &SUPER_ROT2},
+    {2, {native_drop, native_drop}, &SUPER_2DROP},
+};
+
+/* Compile a fused superinstruction for the items starting at i.
+ * Returns how many items were consumed, 0 if nothing matched or
+ * -1 if the items can't be compiled.
+ */
+int compile_fused(KCompiler *c, KArray *code, size_t i) {
+  KVal *v = &code->items[i];
+  size_t n = code->size - i;
+  size_t at;
+
+  if (n >= 5 && inlines(v[0], native_dup) && is_int(v[1], 1) &&
+      inlines(v[2], native_mod) && is_zero(v[3]) &&
+      inlines(v[4], native_equals)) {
+    emit_lit(c, OP_DUP_MODZ, v[1]);
+    return 5;
+  }
+  if (n >= 4 && is_int(v[0], 1) && inlines(v[1], native_mod) &&
+      is_zero(v[2]) && inlines(v[3], native_equals)) {
+    emit_lit(c, OP_MODZ, v[0]);
+    return 4;
+  }
+  if (n >= 2 && v[0].type == KT_INT) {
+    if (inlines(v[1], native_plus)) {
+      emit_lit(c, OP_ADDK, v[0]);
+      return 2;
+    }
+    if (inlines(v[1], native_minus)) {
+      emit_lit(c, OP_SUBK, v[0]);
+      return 2;
+    }
+    if (is_int(v[0], 0)) {
+      if (inlines(v[1], native_pick)) {
+        emit_lit(c, OP_PICK, v[0]);
+        return 2;
+      }
+      if (inlines(v[1], native_move)) {
+        emit_lit(c, OP_MOVE, v[0]);
+        return 2;
+      }
     }
-    break;
   }
+  // unroll small loops like [3 move] 2 times
+  if (n >= 3 && v[0].type == KT_ARRAY && is_int(v[1], 1) &&
+      v[1].data.integer <= 4 &&
+      v[0].data.array->size * v[1].data.integer <= 16 &&
+      inlines(v[2], native_times)) {
+    for (int64_t k = 0; k < v[1].data.integer; k++) {
+      if (!compile_items(c, v[0].data.array))
+        return -1;
+    }
+    return 3;
+  }
+  for (size_t f = 0; f < sizeof(FUSIONS) / sizeof(KFusion); f++) {
+    const KFusion *fu = &FUSIONS[f];
+    if (n < fu->len)
+      continue;
+    size_t k = 0;
+    while (k < fu->len && inlines(v[k], fu->seq[k]))
+      k++;
+    if (k == fu->len) {
+      at = emit(c, OP_NATIVE);
+      c->ops[at].a.native = fu->super;
+      return fu->len;
+    }
+  }
+  return 0;
+}
 
-  default:
-    fprintf(stderr, "Can't execute type: %d\n", v.type);
+bool compile_items(KCompiler *c, KArray *code) {
+  for (size_t i = 0; i < code->size; i++) {
+    KVal v = code->items[i];
+    int fused;
+    if (v.type == KT_ARRAY && v.data.array->size % 2 == 0 &&
+        i + 1 < code->size && inlines(code->items[i + 1], native_cond)) {
+      if (!compile_cond(c, v.data.array))
+        return false;
+      i++;
+    } else if (v.type == KT_ARRAY && i + 1 < code->size &&
+               inlines(code->items[i + 1], native_if)) {
+      if (!compile_if(c, v, NULL))
+        return false;
+      i++;
+    } else if (v.type == KT_ARRAY && i + 2 < code->size &&
+               code->items[i + 1].type == KT_ARRAY &&
+               inlines(code->items[i + 2], native_if_else)) {
+      if (!compile_if(c, v, &code->items[i + 1]))
+        return false;
+      i += 2;
+    } else if ((fused = compile_fused(c, code, i)) != 0) {
+      if (fused < 0)
+        return false;
+      i += fused - 1;
+    } else if (!compile_item(c, v)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+KCode *compile(KCtx *ctx, KArray *arr) {
+  KCompiler c = {.ctx = ctx};
+  if (!compile_items(&c, arr))
+    return &NOT_COMPILABLE;
+  emit(&c, OP_RET);
+  for (size_t i = 0; i < c.nops; i++) {
+    KInstr *in = &c.ops[i];
+    switch (in->op) {
+    case OP_PUSH:
+    case OP_EXEC:
+    case OP_ADDK:
+    case OP_SUBK:
+    case OP_PICK:
+    case OP_MOVE:
+    case OP_MODZ:
+    case OP_DUP_MODZ:
+      in->a.lit = &c.lits[in->a.idx];
+      break;
+    case OP_JUMP:
+    case OP_JUMP_FALSE:
+      in->a.target = &c.ops[in->a.idx];
+      break;
+    default:
+      break;
+    }
+  }
+  // a call that is followed only by jumps to the return can reuse the frame
+  for (size_t i = 0; i < c.nops; i++) {
+    if (c.ops[i].op != OP_CALL)
+      continue;
+    KInstr *next = &c.ops[i + 1];
+    while (next->op == OP_JUMP)
+      next = next->a.target;
+    if (next->op == OP_RET)
+      c.ops[i].op = OP_TAIL;
+  }
+  KCode *code = alloc_node(sizeof(KCode));
+  *code = (KCode){.size = c.nops, .ops = c.ops, .lits = c.lits,
+                  .epoch = heap->epoch};
+  if (c.nops == 2 && c.ops[0].op == OP_NATIVE)
+    code->leaf = c.ops[0].a.native;
+  return code;
+}
+
+/* Not compiled yet, or compiled before a word built into it was redefined */
+bool code_stale(KArray *arr) {
+  return !arr->code ||
+         (arr->code != &NOT_COMPILABLE && arr->code->epoch != heap->epoch);
+}
+
+/* Get compiled code for block, or NULL if it must be run with exec */
+KCode *block_code(KCtx *ctx, KArray *arr) {
+#ifdef KOKOKI_NO_COMPILE
+  return NULL;
+#else
+  if (code_stale(arr)) {
+    LOCK(heap->dict_lock);
+    if (code_stale(arr)) // another thread may have compiled it
+      arr->code = compile(ctx, arr);
+    gc_write(arr);
+    UNLOCK(heap->dict_lock);
+  }
+  return arr->code == &NOT_COMPILABLE ? NULL : arr->code;
+#endif
+}
+
+/* Compiled code for the body of a loop that is run many times, or NULL */
+KCode *loop_code(KCtx *ctx, KVal body) {
+  return body.type == KT_BLOCK ? block_code(ctx, body.data.array) : NULL;
+}
+
+/* Profiling counts calls and time of words while ctx->profiling is set.
+ * Calls are counted in a call tree so the time of each call path is kept
+ * for folded stack output, and per word for the report. Deeper paths than
+ * KOKOKI_PROFILE_DEPTH are counted in the deepest node. Natives called
+ * directly by compiled code (superinstructions) count as their caller.
+ */
+#define KOKOKI_PROFILE_DEPTH 128
+
+typedef struct KProfWord {
+  KWord *word;
+  uint64_t calls;
+  double self, total; // total doesn't count recursive calls again
+  size_t active;      // calls running now
+  struct KProfWord *next;
+} KProfWord;
+
+typedef struct KProfNode {
+  KProfWord *word; // NULL for the root
+  struct KProfNode *parent, *children, *next;
+  size_t depth;
+  double self;
+} KProfNode;
+
+typedef struct KProfFrame {
+  KProfNode *node;
+  KProfWord *word;
+  double start, child;
+  size_t rsize; // return stack size in the callee for compiled calls, or 0
+} KProfFrame;
+
+struct KProfile {
+  KProfNode root;
+  KProfWord *words;
+  KProfFrame *frames;
+  size_t nframes, cframes;
+};
+
+double prof_clock(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+KProfWord *prof_word(KProfile *p, KWord *word) {
+  for (KProfWord *w = p->words; w; w = w->next)
+    if (w->word == word)
+      return w;
+  KProfWord *w = calloc(1, sizeof(KProfWord));
+  w->word = word;
+  w->next = p->words;
+  return p->words = w;
+}
+
+void prof_enter(KCtx *ctx, KWord *word, size_t rsize) {
+  KProfile *p = ctx->profile;
+  KProfNode *parent = p->nframes ? p->frames[p->nframes - 1].node : &p->root;
+  KProfNode *node = parent;
+  if (parent->depth < KOKOKI_PROFILE_DEPTH) {
+    for (node = parent->children; node; node = node->next)
+      if (node->word->word == word)
+        break;
+    if (!node) {
+      node = calloc(1, sizeof(KProfNode));
+      *node = (KProfNode){.word = prof_word(p, word),
+                          .parent = parent,
+                          .next = parent->children,
+                          .depth = parent->depth + 1};
+      parent->children = node;
+    }
+  }
+  if (p->nframes == p->cframes) {
+    p->cframes = p->cframes ? p->cframes * 2 : 64;
+    p->frames = realloc(p->frames, p->cframes * sizeof(KProfFrame));
+  }
+  KProfWord *w = node->word && node->word->word == word ? node->word
+                                                        : prof_word(p, word);
+  w->calls++;
+  w->active++;
+  p->frames[p->nframes++] =
+      (KProfFrame){.node = node, .word = w, .start = prof_clock(),
+                   .rsize = rsize};
+}
+
+void prof_exit(KCtx *ctx) {
+  KProfile *p = ctx->profile;
+  if (!p->nframes)
+    return;
+  KProfFrame *f = &p->frames[--p->nframes];
+  double t = prof_clock() - f->start;
+  f->node->self += t - f->child;
+  f->word->self += t - f->child;
+  if (!--f->word->active)
+    f->word->total += t;
+  if (p->nframes)
+    p->frames[p->nframes - 1].child += t;
+}
+
+/* Compiled code is returning with ctx->rsize frames */
+void prof_ret(KCtx *ctx) {
+  KProfile *p = ctx->profile;
+  if (p->nframes && p->frames[p->nframes - 1].rsize == ctx->rsize)
+    prof_exit(ctx);
+}
+
+void prof_free_node(KProfNode *node) {
+  for (KProfNode *n = node->children, *next; n; n = next) {
+    next = n->next;
+    prof_free_node(n);
+    free(n);
+  }
+}
+
+void prof_free(KProfile *p) {
+  if (!p)
+    return;
+  prof_free_node(&p->root);
+  for (KProfWord *w = p->words, *next; w; w = next) {
+    next = w->next;
+    free(w);
+  }
+  free(p->frames);
+  free(p);
+}
+
+void rpush(KCtx *ctx, KCode *code, KInstr *ip) {
+  if (ctx->rsize == ctx->rcapacity) {
+    ctx->rcapacity = ctx->rcapacity == 0 ? 64 : ctx->rcapacity * 1.62;
+    ctx->rstack = alloc_realloc(ctx->rstack, ctx->rcapacity * sizeof(KFrame));
+    if (!ctx->rstack) {
+      fprintf(stderr, "Out of memory");
+      exit(1);
+    }
+  }
+  ctx->rstack[ctx->rsize++] = (KFrame){.code = code, .ip = ip};
+}
+
+#ifdef KOKOKI_GC_GENERATIONAL
+void safepoint(KCtx *ctx) {
+  void *roots[] = {ctx->stack->items, ctx->rstack};
+  tgc_safepoint(&heap->gc, roots, 2);
+}
+#endif
+
+/* Inner interpreter, runs code until it returns */
+void run(KCtx *ctx, KCode *code) {
+  size_t base = ctx->rsize;
+  KInstr *ip = code->ops;
+#ifdef KOKOKI_THREADED
+#define DO(op) [op] = &&L_##op,
+  static void *dispatch[] = {DO_OPS};
+#undef DO
+#define OP(op) L_##op:
+#define NEXT goto *dispatch[ip->op]
+  NEXT;
+#else
+#define OP(op) case op:
+#define NEXT continue
+  for (;;) switch (ip->op) {
+#endif
+  OP(OP_PUSH) {
+    stack_push(ctx->stack, *ip->a.lit);
+    ip++;
+    NEXT;
+  }
+  OP(OP_NATIVE) {
+    const KNative *n = ip->a.native;
+    ip++;
+    call_native(ctx, n);
+    if (ctx->tail.type != KT_NIL)
+      goto tail;
+    NEXT;
+  }
+  OP(OP_TAIL)
+  OP(OP_CALL) {
+    KWord *word = ip->a.word;
+    // the profiler needs a frame to attribute the callee's time to
+    bool tail = ip->op == OP_TAIL && !ctx->profiling;
+    ip++;
+    gc_safepoint(ctx);
+    if (word->value.type == KT_BLOCK) {
+      KCode *callee = block_code(ctx, word->value.data.array);
+      if (callee && callee->leaf) {
+        if (ctx->profiling)
+          prof_enter(ctx, word, 0);
+        call_native(ctx, callee->leaf);
+        if (ctx->profiling)
+          prof_exit(ctx);
+        if (ctx->tail.type != KT_NIL)
+          goto tail;
+        NEXT;
+      } else if (callee) {
+        if (!tail)
+          rpush(ctx, code, ip);
+        if (ctx->profiling)
+          prof_enter(ctx, word, ctx->rsize);
+        code = callee;
+        ip = callee->ops;
+        NEXT;
+      }
+    } else if (word->value.type == KT_NATIVE) {
+      if (ctx->profiling)
+        prof_enter(ctx, word, 0);
+      call_native(ctx, word->value.data.native);
+      if (ctx->profiling)
+        prof_exit(ctx);
+      if (ctx->tail.type != KT_NIL)
+        goto tail;
+      NEXT;
+    }
+    exec(ctx, (KVal){.type = KT_WORD, .data.word = word});
+    NEXT;
+  }
+  OP(OP_EXEC) {
+    KVal v = *ip->a.lit;
+    ip++;
+    exec(ctx, v);
+    NEXT;
+  }
+  OP(OP_JUMP) {
+    ip = ip->a.target;
+    NEXT;
+  }
+  OP(OP_JUMP_FALSE) {
+    ip = falsy(stack_pop(ctx->stack)) ? ip->a.target : ip + 1;
+    NEXT;
+  }
+  OP(OP_ADDK) {
+    KStack *s = ctx->stack;
+    if (!s->size) {
+      stack_push(s, stack_underflow());
+    } else if (s->items[s->size - 1].type == KT_INT) {
+      KVal *top = &s->items[s->size - 1];
+      *top = int_val((uint64_t)top->data.integer + ip->a.lit->data.integer);
+    } else {
+      stack_push(s, *ip->a.lit);
+      native_plus(ctx);
+    }
+    ip++;
+    NEXT;
+  }
+  OP(OP_SUBK) {
+    KStack *s = ctx->stack;
+    if (!s->size) {
+      stack_push(s, stack_underflow());
+    } else if (s->items[s->size - 1].type == KT_INT) {
+      KVal *top = &s->items[s->size - 1];
+      *top = int_val((uint64_t)top->data.integer - ip->a.lit->data.integer);
+    } else {
+      stack_push(s, *ip->a.lit);
+      native_minus(ctx);
+    }
+    ip++;
+    NEXT;
+  }
+  OP(OP_PICK) {
+    KStack *s = ctx->stack;
+    size_t n = (size_t)ip->a.lit->data.integer;
+    if (n < s->size) {
+      stack_push(s, s->items[s->size - 1 - n]);
+    } else {
+      stack_push(s, *ip->a.lit);
+      native_pick(ctx);
+    }
+    ip++;
+    NEXT;
+  }
+  OP(OP_MOVE) {
+    KStack *s = ctx->stack;
+    size_t n = (size_t)ip->a.lit->data.integer;
+    if (n < s->size) {
+      KVal *from = &s->items[s->size - 1 - n];
+      KVal item = *from;
+      memmove(from, from + 1, n * sizeof(KVal));
+      s->items[s->size - 1] = item;
+    } else {
+      stack_push(s, *ip->a.lit);
+      native_move(ctx);
+    }
+    ip++;
+    NEXT;
+  }
+  OP(OP_MODZ) {
+    KStack *s = ctx->stack;
+    if (!s->size) {
+      stack_push(s, stack_underflow());
+    } else if (s->items[s->size - 1].type == KT_INT) {
+      KVal *top = &s->items[s->size - 1];
+      *top = bool_val(int_mod(top->data.integer, ip->a.lit->data.integer) == 0);
+    } else {
+      stack_push(s, *ip->a.lit);
+      native_mod(ctx);
+      stack_push(s, int_val(0));
+      native_equals(ctx);
+    }
+    ip++;
+    NEXT;
+  }
+  OP(OP_DUP_MODZ) {
+    KStack *s = ctx->stack;
+    if (!s->size) {
+      stack_push(s, stack_underflow());
+    } else if (s->items[s->size - 1].type == KT_INT) {
+      int64_t top = s->items[s->size - 1].data.integer;
+      stack_push(s, bool_val(int_mod(top, ip->a.lit->data.integer) == 0));
+    } else {
+      stack_push(s, s->items[s->size - 1]);
+      stack_push(s, *ip->a.lit);
+      native_mod(ctx);
+      stack_push(s, int_val(0));
+      native_equals(ctx);
+    }
+    ip++;
+    NEXT;
+  }
+  OP(OP_RET) {
+    if (ctx->rsize == base)
+      return;
+    if (ctx->profiling)
+      prof_ret(ctx);
+    KFrame f = ctx->rstack[--ctx->rsize];
+    code = f.code;
+    ip = f.ip;
+    NEXT;
+  }
+  tail: {
+    // a native left code to run, right before returning it needs no frame
+    KVal v = take_tail(ctx);
+    KCode *callee = v.type == KT_BLOCK ? block_code(ctx, v.data.array) : NULL;
+    if (!callee) {
+      exec(ctx, v);
+      NEXT;
+    }
+    if (ip->op != OP_RET)
+      rpush(ctx, code, ip);
+    code = callee;
+    ip = callee->ops;
+    NEXT;
+  }
+#ifndef KOKOKI_THREADED
+  }
+#endif
+#undef OP
+#undef NEXT
+}
 
+void exec(KCtx *ctx, KVal v) {
+  // values in tail position continue the loop instead of recursing
+  for (;;) {
+    //debug_exec(ctx, v);
+    gc_safepoint(ctx);
+    switch (v.type) {
+    case KT_NAME: {
+      KVal word = names_get(ctx, v);
+      if (word.type != KT_WORD || word.data.word->value.type == KT_NIL) {
+        fprintf(stderr, "Undefined name: %.*s\n",
+                (int)v.data.symbol->name.len, v.data.symbol->name.data);
+      } else {
+        // go through the word when profiling so it gets counted
+        v = ctx->profiling ? word : word.data.word->value;
+        continue;
+      }
+      break;
+    }
+    case KT_WORD: {
+      KWord *word = v.data.word;
+      if (word->value.type == KT_NIL) {
+        fprintf(stderr, "Undefined name: %.*s\n", (int)word->name.len,
+                word->name.data);
+      } else if (ctx->profiling) {
+        prof_enter(ctx, word, 0);
+        exec(ctx, word->value);
+        prof_exit(ctx);
+      } else {
+        v = word->value;
+        continue;
+      }
+      break;
+    }
+    case KT_NATIVE:
+      call_native(ctx, v.data.native);
+      if (ctx->tail.type == KT_NIL)
+        break;
+      v = take_tail(ctx);
+      continue;
+    case KT_NIL:
+    case KT_TRUE:
+    case KT_FALSE:
+    case KT_NUMBER:
+    case KT_INT:
+    case KT_STRING:
+    case KT_ARRAY:
+    case KT_HASHMAP:
+    case KT_FILE:
+    case KT_VECTOR:
+    case KT_SEQ:
+    case KT_REF_NAME:
+      stack_push(ctx->stack, v);
+      break;
+
+    case KT_DEFINITION: {
+      KVal name = arr_shift(v.data.array);
+      v.type = KT_BLOCK;
+      resolve(ctx, v.data.array);
+      word_define(word_entry(ctx, name), v);
+      //printf("defined name: ");
+      //kval_dump(name);
+      //printf("\n");
+      break;
+    }
+
+    case KT_BLOCK: {
+      KArray *arr = v.data.array;
+      KCode *code = block_code(ctx, arr);
+      if (code) {
+        run(ctx, code);
+        break;
+      }
+      if (!arr->size)
+        break;
+      for (size_t i = 0; i + 1 < arr->size; i++) {
+        exec(ctx, arr->items[i]);
+      }
+      v = arr->items[arr->size - 1];
+      continue;
+    }
+
+    default:
+      fprintf(stderr, "Can't execute type: %d\n", v.type);
+    }
+    return;
   }
 }
 
 KVal *kval_new(KVal v) {
-  KVal *kv = tgc_alloc(&gc, sizeof(KVal));
+  KVal *kv = alloc_node(sizeof(KVal));
   if(!kv) {
     fprintf(stderr, "Out of memory!");
     exit(1);
@@ -666,94 +2598,300 @@ KVal *kval_new(KVal v) {
   return kv;
 }
 
-void native(KCtx * ctx, const char *name, void (*native)(KCtx *)) {
-  size_t len = strlen(name);
-  hm_put(ctx->names,
-         (KVal){.type = KT_NAME, .data.string = {.len = len, .data = (char*)name}},
-         (KVal){.type = KT_NATIVE, .data.native = native});
+void native(KCtx *ctx, const char *name, void (*fn)(KCtx *), size_t in,
+            size_t out) {
+  KVal n = (KVal){.type = KT_NAME,
+                  .data.symbol = intern(ctx, name, strlen(name))};
+  KNative *nat = alloc_node(sizeof(KNative));
+  *nat = (KNative){.fn = fn, .in = in, .out = out};
+  word_define(word_entry(ctx, n), (KVal){.type = KT_NATIVE, .data.native = nat});
 }
-void kokoki_native(KCtx *ctx, const char *name, void (*callback)(KCtx *)) {
-  native(ctx, name, callback);
+void kokoki_native(KCtx *ctx, const char *name, void (*callback)(KCtx *),
+                   size_t in, size_t out) {
+  ENTER(ctx);
+  native(ctx, name, callback, in, out);
+  LEAVE();
 }
 
-#define num_op(name, op, type)                                                 \
+/* Operands of an elementwise op, at least one is a vector. A number is
+ * applied to every item, scalar tells which operand is one (1 or 2).
+ */
+typedef struct KVecArgs {
+  size_t n;
+  int scalar;
+  bool ints; // both are integers, else use the double pointers
+  const int64_t *xi, *yi;
+  const double *xd, *yd;
+  int64_t si; // the number operand
+  double sd;
+} KVecArgs;
+
+/* Items of operand v as doubles, int vectors are converted in the arena */
+const double *vec_doubles(KCtx *ctx, KVal v, double *scalar) {
+  if (v.type != KT_VECTOR) {
+    *scalar = kval_number(v);
+    return scalar;
+  }
+  KVector *vec = v.data.vector;
+  if (vec->type == KT_NUMBER)
+    return vec->items.numbers;
+  double *d = arena_alloc(ctx, vec->size * sizeof(double));
+  for (size_t i = 0; i < vec->size; i++)
+    d[i] = (double)vec->items.ints[i];
+  return d;
+}
+
+bool vec_args(KCtx *ctx, KVal a, KVal b, bool ints, KVecArgs *v, KVal *e) {
+  if (!(a.type == KT_VECTOR || is_number(a)) ||
+      !(b.type == KT_VECTOR || is_number(b))) {
+    err(*e, "Expected vectors or numbers");
+    return false;
+  }
+  if (a.type == KT_VECTOR && b.type == KT_VECTOR &&
+      a.data.vector->size != b.data.vector->size) {
+    err(*e, "Vectors have different sizes (%zu and %zu)", a.data.vector->size,
+        b.data.vector->size);
+    return false;
+  }
+  *v = (KVecArgs){.scalar = a.type != KT_VECTOR ? 1
+                            : b.type != KT_VECTOR ? 2
+                                                  : 0};
+  v->n = (v->scalar == 1 ? b : a).data.vector->size;
+  v->ints = ints &&
+            (a.type == KT_VECTOR ? a.data.vector->type : a.type) == KT_INT &&
+            (b.type == KT_VECTOR ? b.data.vector->type : b.type) == KT_INT;
+  if (v->ints) {
+    v->si = kval_int(v->scalar == 1 ? a : b);
+    v->xi = v->scalar == 1 ? &v->si : a.data.vector->items.ints;
+    v->yi = v->scalar == 2 ? &v->si : b.data.vector->items.ints;
+  } else {
+    v->xd = vec_doubles(ctx, a, &v->sd);
+    v->yd = vec_doubles(ctx, b, &v->sd);
+  }
+  return true;
+}
+
+/* out[i] = expr for every item, with a and b the items of the operands.
+ * The output is a new vector, so it doesn't overlap the operands.
+ */
+#define VEC_APPLY(T, OT, out, x, y, n, scalar, expr)                            \
+  {                                                                            \
+    OT *restrict o = (out);                                                    \
+    const T *restrict xs = (x), *restrict ys = (y);                            \
+    if (scalar == 1) {                                                         \
+      T a = xs[0];                                                             \
+      for (size_t i = 0; i < n; i++) {                                         \
+        T b = ys[i];                                                           \
+        o[i] = (expr);                                                         \
+      }                                                                        \
+    } else if (scalar == 2) {                                                  \
+      T b = ys[0];                                                             \
+      for (size_t i = 0; i < n; i++) {                                         \
+        T a = xs[i];                                                           \
+        o[i] = (expr);                                                         \
+      }                                                                        \
+    } else {                                                                   \
+      for (size_t i = 0; i < n; i++) {                                         \
+        T a = xs[i], b = ys[i];                                                \
+        o[i] = (expr);                                                         \
+      }                                                                        \
+    }                                                                          \
+  }
+
+/* Elementwise versions of the arithmetic and comparison words. Integer
+ * vectors stay integers except for division, comparisons give vectors of
+ * 0 and 1 that filter takes as a mask.
+ */
+#define vec_op(name, op, kind)                                                 \
+  KVal vec_##name(KCtx *ctx, KVal a, KVal b) {                                 \
+    KArenaMark mark = arena_mark(ctx);                                         \
+    KVecArgs v;                                                                \
+    KVal e;                                                                    \
+    if (!vec_args(ctx, a, b, kind##_VEC_INTS, &v, &e))                         \
+      return e;                                                                \
+    KVector *out = vec_new(kind##_VEC_TYPE(v.ints), v.n);                      \
+    if (v.ints) {                                                              \
+      VEC_APPLY(int64_t, int64_t, out->items.ints, v.xi, v.yi, v.n,            \
+                v.scalar, kind##_VEC_INT(op));                                 \
+    } else {                                                                   \
+      VEC_APPLY(double, kind##_VEC_OT, kind##_VEC_OUT(out), v.xd, v.yd,        \
+                v.n, v.scalar, a op b);                                        \
+    }                                                                          \
+    arena_release(ctx, mark);                                                  \
+    return vec_val(out);                                                       \
+  }
+
+#define NUM_VEC_INTS true
+#define NUM_VEC_TYPE(ints) ((ints) ? KT_INT : KT_NUMBER)
+#define NUM_VEC_INT(op) (int64_t)((uint64_t)a op (uint64_t)b)
+#define NUM_VEC_OUT(out) out->items.numbers
+#define NUM_VEC_OT double
+
+#define DIV_VEC_INTS false
+#define DIV_VEC_TYPE(ints) KT_NUMBER
+#define DIV_VEC_INT(op) ((void)a, (void)b, 0) // division is done on doubles
+#define DIV_VEC_OUT(out) out->items.numbers
+#define DIV_VEC_OT double
+
+#define BOOL_VEC_INTS true
+#define BOOL_VEC_TYPE(ints) KT_INT
+#define BOOL_VEC_INT(op) a op b
+#define BOOL_VEC_OUT(out) out->items.ints
+#define BOOL_VEC_OT int64_t
+
+/* Arithmetic works in place on the top two stack items (a b), integers
+ * stay integers unless one of the operands is a double.
+ */
+#define num_op(name, op, kind)                                                 \
   void native_##name(KCtx *ctx) {                                              \
-    KVal b = arr_pop(ctx->stack);                                              \
-    KVal a = arr_pop(ctx->stack);                                              \
-    arr_push(ctx->stack, type(op));                                            \
+    KStack *s = ctx->stack;                                                    \
+    KVal *a = &s->items[s->size - 2], *b = a + 1;                              \
+    if (a->type == KT_INT && b->type == KT_INT) {                              \
+      kind##_INT(op);                                                          \
+    } else if (is_number(*a) && is_number(*b)) {                               \
+      double x = kval_number(*a), y = kval_number(*b);                         \
+      kind##_DBL(op);                                                          \
+    } else if (a->type == KT_VECTOR || b->type == KT_VECTOR) {                 \
+      *a = vec_##name(ctx, *a, *b);                                            \
+    } else {                                                                   \
+      s->size -= 2;                                                            \
+      KVal e;                                                                  \
+      err(e, "Expected two numbers for " #op);                                 \
+      OUT(e);                                                                  \
+      return;                                                                  \
+    }                                                                          \
+    s->size--;                                                                 \
   }
 
-#define NUM(op)                                                                \
-  (KVal) { .type = KT_NUMBER, .data.number = a.data.number op b.data.number }
+#define NUM_INT(op)                                                            \
+  *a = int_val((uint64_t)a->data.integer op (uint64_t)b->data.integer)
+#define NUM_DBL(op) *a = (KVal){.type = KT_NUMBER, .data.number = x op y}
 
-#define BOOL(op)                                                             \
-    (KVal) { .type = (a.data.number op b.data.number) ? KT_TRUE : KT_FALSE }
+// integer division stays integer only when there's no remainder
+#define DIV_INT(op)                                                            \
+  int64_t x = a->data.integer, y = b->data.integer;                            \
+  if (y != 0 && int_mod(x, y) == 0 && !(x == INT64_MIN && y == -1))          \
+    *a = int_val(x op y);                                                      \
+  else                                                                         \
+    *a = (KVal){.type = KT_NUMBER, .data.number = (double)x op (double)y}
+#define DIV_DBL(op) NUM_DBL(op)
+
+#define BOOL_INT(op) *a = bool_val(a->data.integer op b->data.integer)
+#define BOOL_DBL(op) *a = bool_val(x op y)
 
 #define DO_NUM_OPS                                                             \
   DO(plus, +, NUM)                                                             \
   DO(minus, -, NUM)                                                            \
   DO(mult, *, NUM)                                                             \
-  DO(div, /, NUM)                                                              \
+  DO(div, /, DIV)                                                              \
   DO(lt, <, BOOL)                                                              \
   DO(lte, <=, BOOL)                                                            \
   DO(gt, >, BOOL)                                                              \
   DO(gte, >=, BOOL)
 
-#define DO(name, op, type) num_op(name, op, type)
-DO_NUM_OPS
-#undef DO
-
 #define STRINGIFY2(X) #X
 #define STRINGIFY(X) STRINGIFY2(X)
 
+/* Natives use these for the items and results in their declared stack
+ * effect. They don't check the stack, natives that run code must use
+ * stack_push / stack_pop for anything after that.
+ */
+#define POP() (ctx->stack->items[--ctx->stack->size])
+#define TOP() (ctx->stack->items[ctx->stack->size - 1])
+
 #define IN(name, typename)                                                     \
-  KVal name = arr_pop(ctx->stack);                                             \
+  KVal name = POP();                                                           \
   if (name.type != typename) {                                                 \
     KVal errv;                                                                 \
     err(errv, "Expected type " STRINGIFY(type));                               \
-    arr_push(ctx->stack, errv);                                                \
+    stack_push(ctx->stack, errv);                                              \
+    return;                                                                    \
+  }
+
+#define IN_NUM(name)                                                           \
+  KVal name = POP();                                                           \
+  if (!is_number(name)) {                                                      \
+    KVal errv;                                                                 \
+    err(errv, "Expected a number");                                            \
+    stack_push(ctx->stack, errv);                                              \
     return;                                                                    \
   }
 
+#define IN_VEC(name)                                                           \
+  KVal name = POP();                                                           \
+  if (name.type != KT_VECTOR) {                                                \
+    KVal errv;                                                                 \
+    err(errv, "Expected a vector");                                            \
+    stack_push(ctx->stack, errv);                                              \
+    return;                                                                    \
+  }
 
-#define IN_ANY(name) KVal name = arr_pop(ctx->stack)
-#define IN_EXEC(name)                                                          \
-  KVal name = arr_pop(ctx->stack);                                             \
-  if (name.type == KT_ARRAY)                                                   \
-  name.type = KT_BLOCK
+#define IN_ANY(name) KVal name = POP()
+#define IN_EXEC(name) KVal name = code_block(ctx, POP())
 
-#define OUT(v) arr_push(ctx->stack, (v))
+#define OUT(v) (ctx->stack->items[ctx->stack->size++] = (v))
 
+#define DO(name, op, type) vec_op(name, op, type)
+DO_NUM_OPS
+#undef DO
+
+#define DO(name, op, type) num_op(name, op, type)
+DO_NUM_OPS
+#undef DO
 
 void native_mod(KCtx *ctx) {
-  KVal b = arr_pop(ctx->stack);
-  KVal a = arr_pop(ctx->stack);
-  arr_push(ctx->stack, (KVal){
-      .type = KT_NUMBER,
-      .data.number = (double)((long)a.data.number %
-                              (long)b.data.number)
-    });
+  KStack *s = ctx->stack;
+  KVal *a = &s->items[s->size - 2], *b = a + 1;
+  KVal e;
+  if (!is_number(*a) || !is_number(*b)) {
+    err(e, "Expected two numbers for %%");
+  } else if (kval_int(*b) == 0) {
+    err(e, "Division by zero");
+  } else {
+    *a = int_val(int_mod(kval_int(*a), kval_int(*b)));
+    s->size--;
+    return;
+  }
+  s->size -= 2;
+  OUT(e);
 }
 
 void native_print(KCtx *ctx) {
-  kval_dump(arr_pop(ctx->stack));
+  kval_write(&ctx->out, stack_pop(ctx->stack));
 }
 
-void native_nl(KCtx *ctx) { printf("\n"); }
+/* Output is written at newlines only if the buffer is half full, so lines
+ * aren't split between writes, or to a terminal.
+ */
+void native_nl(KCtx *ctx) {
+  KOut *o = &ctx->out;
+  out_write(o, "\n", 1);
+  if (o->lines || o->len >= o->capacity / 2) {
+    out_flush(o);
+    if (o->lines)
+      fflush(stdout);
+  }
+}
+
+void native_flush(KCtx *ctx) {
+  out_flush(&ctx->out);
+  fflush(stdout);
+}
 
 void native_cond(KCtx *ctx) {
-  KVal cond = arr_pop(ctx->stack);
+  KVal cond = stack_pop(ctx->stack);
   if (cond.type != KT_ARRAY || cond.data.array->size % 2) {
     KVal e;
     err(e, "Cond requires an array with alternating condition/action pairs.");
-    arr_push(ctx->stack, e);
+    stack_push(ctx->stack, e);
   } else {
-    for (size_t i = 0; i < cond.data.array->size - 1; i++) {
+    resolve(ctx, cond.data.array);
+    for (size_t i = 0; i < cond.data.array->size / 2; i++) {
       KVal _if = cond.data.array->items[i * 2 + 0];
       if(_if.type == KT_ARRAY) _if.type = KT_BLOCK;
       KVal _then = cond.data.array->items[i * 2 + 1];
       exec(ctx, _if);
-      KVal result = arr_pop(ctx->stack);
+      KVal result = stack_pop(ctx->stack);
       //printf("IF ");
       //kval_dump(_if);
       //printf(" THEN ");
@@ -764,19 +2902,44 @@ void native_cond(KCtx *ctx) {
       if (!falsy(result)) {
         // we are done, run action and return
         if(_then.type == KT_ARRAY) _then.type = KT_BLOCK;
-        exec(ctx, _then);
+        exec_tail(ctx, _then);
         return;
       }
     }
   }
 }
 
+/* (bool code --)
+ * Run code if bool is truthy
+ */
+void native_if(KCtx *ctx) {
+  KVal code = POP();
+  KVal b = POP();
+  if (!falsy(b)) {
+    if (code.type == KT_ARRAY)
+      code.type = KT_BLOCK;
+    exec_tail(ctx, code);
+  }
+}
+
+/* (bool then else --)
+ * Run then if bool is truthy, else the else code
+ */
+void native_if_else(KCtx *ctx) {
+  KVal otherwise = POP();
+  KVal then = POP();
+  KVal code = falsy(POP()) ? otherwise : then;
+  if (code.type == KT_ARRAY)
+    code.type = KT_BLOCK;
+  exec_tail(ctx, code);
+}
+
 /* Copy Nth value from top and push it to top */
 void native_pick(KCtx *ctx) {
-  IN(num, KT_NUMBER);
+  IN_NUM(num);
   KVal error;
   size_t sz = ctx->stack->size;
-  size_t idx = (size_t) num.data.number;
+  size_t idx = (size_t)kval_int(num);
   if (sz <= idx) {
     err(error, "Can't pick item %zu from stack that has size %zu", idx, sz);
     OUT(error);
@@ -787,23 +2950,24 @@ void native_pick(KCtx *ctx) {
 
 /* Move Nth value from top and push it to top */
 void native_move(KCtx *ctx) {
-  IN(num, KT_NUMBER);
+  IN_NUM(num);
   KVal error;
   size_t sz = ctx->stack->size;
-  size_t idx = (size_t) num.data.number;
+  size_t idx = (size_t)kval_int(num);
   if (sz <= idx) {
     err(error, "Can't move item %zu from stack that has size %zu", idx, sz);
     OUT(error);
   } else {
-    KVal item = arr_remove_nth(ctx->stack, sz - 1 - idx);
-    OUT(item);
+    KVal *items = &ctx->stack->items[sz - 1 - idx];
+    KVal item = items[0];
+    memmove(items, items + 1, idx * sizeof(KVal));
+    items[idx] = item;
   }
 }
 
 void native_dup(KCtx *ctx) {
-  KVal v = arr_pop(ctx->stack);
-  arr_push(ctx->stack, v);
-  arr_push(ctx->stack, v);
+  KVal v = TOP();
+  OUT(v);
 }
 void native_rot(KCtx *ctx) {
   // rotate 3rd item to top
@@ -817,48 +2981,376 @@ void native_rot(KCtx *ctx) {
 }
 
 void native_swap(KCtx *ctx) {
-  KVal b = arr_pop(ctx->stack);
-  KVal a = arr_pop(ctx->stack);
-  arr_push(ctx->stack, b);
-  arr_push(ctx->stack, a);
+  KVal *top = &TOP();
+  KVal b = top[0];
+  top[0] = top[-1];
+  top[-1] = b;
 }
-void native_drop(KCtx *ctx) { arr_pop(ctx->stack); }
+void native_drop(KCtx *ctx) { ctx->stack->size--; }
+
 
 void native_exec(KCtx *ctx) {
-  KVal arr = arr_pop(ctx->stack);
-  if (arr.type == KT_ARRAY) {
-    for (size_t i = 0; i < arr.data.array->size; i++) {
-      exec(ctx, arr.data.array->items[i]);
-    }
+  IN_EXEC(code);
+  exec_tail(ctx, code);
+}
+
+/* NUL terminated copy of string for C APIs, allocated in the arena */
+char *c_str(KCtx *ctx, KString s) {
+  char *str = arena_alloc(ctx, s.len + 1);
+  memcpy(str, s.data, s.len);
+  str[s.len] = 0;
+  return str;
+}
+
+/* Files at least this big are mapped instead of read */
+#define KOKOKI_MMAP_MIN (64 * 1024)
+
+void unmap(void *ptr) {
+  KMapping *m = ptr;
+  munmap(m->addr, m->len);
+}
+
+/* Big files are mapped read only, strings are never modified in place.
+ * The string is a slice of the mapping, its base is a collected header
+ * that unmaps the file once no string refers to it. Files too big for a
+ * slice are read.
+ */
+bool slurp_mmap(int fd, size_t len, KVal *out) {
+  if (len > UINT32_MAX)
+    return false;
+  void *addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED)
+    return false;
+  KMapping *m = alloc_dtor(sizeof(KMapping), unmap);
+  *m = (KMapping){.addr = addr, .len = len};
+  *out = (KVal){.type = KT_STRING, .slice = KS_MAPPED};
+  out->data.slice = (KSlice){.len = (uint32_t)len, .base = (char *)m};
+  return true;
+}
+
+void native_slurp(KCtx *ctx) {
+  IN(name, KT_STRING);
+  KVal error;
+  KArenaMark mark = arena_mark(ctx);
+  char *filename = c_str(ctx, kval_str(&name));
+  FILE *fp = fopen(filename, "r");
+  struct stat b;
+  if (!fp || fstat(fileno(fp), &b) != 0) {
+    err(error, "Can't read file %s: %s", filename, strerror(errno));
+    arena_release(ctx, mark);
+    if (fp)
+      fclose(fp);
+    OUT(error);
+    return;
+  }
+  arena_release(ctx, mark);
+  KVal contents;
+  size_t len = (size_t)b.st_size;
+  if (len >= KOKOKI_MMAP_MIN && slurp_mmap(fileno(fp), len, &contents)) {
+    fclose(fp);
+    OUT(contents);
+    return;
+  }
+  char *data = str_alloc(&contents, len);
+  size_t n = fread(data, 1, len, fp);
+  fclose(fp);
+  if (n < len) // file shrank since fstat
+    contents = str_val((KString){.len = n, .data = data});
+  OUT(contents);
+}
+
+/* Files are read a line at a time through stdio buffering */
+typedef struct KFile {
+  FILE *fp;
+  char *line; // line buffer reused between reads
+  size_t size;
+} KFile;
+
+void close_file(void *ptr) {
+  KFile *f = ptr;
+  if (f->fp)
+    fclose(f->fp);
+  free(f->line);
+  f->fp = NULL;
+  f->line = NULL;
+}
+
+/* (filename -- file)
+ * open file for reading, it is closed when no longer used or with close
+ */
+void native_open(KCtx *ctx) {
+  IN(name, KT_STRING);
+  KVal ret;
+  KArenaMark mark = arena_mark(ctx);
+  char *filename = c_str(ctx, kval_str(&name));
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    err(ret, "Can't open file %s: %s", filename, strerror(errno));
   } else {
-    exec(ctx, arr);
+    KFile *f = alloc_dtor(sizeof(KFile), close_file);
+    f->fp = fp;
+    ret = (KVal){.type = KT_FILE, .data.file = f};
   }
+  arena_release(ctx, mark);
+  OUT(ret);
 }
 
-void native_slurp(KCtx *ctx) {
-  char filename[512];
-  KVal name = arr_pop(ctx->stack);
-  KVal err;
-  if (name.type != KT_STRING) {
-    err(name, "Slurp requires a string filename");
-    arr_push(ctx->stack, err);
+/* (file --) */
+void native_close(KCtx *ctx) {
+  IN(file, KT_FILE);
+  close_file(file.data.file);
+}
+
+/* Read next line without the newline, false at end of file */
+bool file_line(KFile *f, KVal *out) {
+  if (!f->fp)
+    return false;
+  ssize_t n = getline(&f->line, &f->size, f->fp);
+  if (n < 0)
+    return false;
+  if (n && f->line[n - 1] == '\n')
+    n--;
+  memcpy(str_alloc(out, (size_t)n), f->line, n);
+  return true;
+}
+
+/* (file -- file line)
+ * read next line, nil at end of file
+ */
+void native_read_line(KCtx *ctx) {
+  IN(file, KT_FILE);
+  KVal line;
+  OUT(file);
+  OUT(file_line(file.data.file, &line) ? line : (KVal){.type = KT_NIL});
+}
+
+/* (filename code --)
+ * run code with each line of file on top of the stack
+ */
+void native_each_line(KCtx *ctx) {
+  IN_EXEC(code);
+  native_open(ctx);
+  KVal file = stack_pop(ctx->stack);
+  if (file.type != KT_FILE) {
+    stack_push(ctx->stack, file);
     return;
-  } else if (name.data.string.len > 511) {
-    err(name, "Too long filename");
-    arr_push(ctx->stack, err);
+  }
+  KVal line;
+  while (file_line(file.data.file, &line)) {
+    stack_push(ctx->stack, line);
+    exec(ctx, code);
+  }
+  close_file(file.data.file);
+}
+
+/* Lazy sequences
+ *
+ * A sequence describes items without making them: a range of integers,
+ * the items of an array, string, vector or file, or a stage that maps,
+ * filters or takes the items of another sequence. each, fold and
+ * into-array pull the items through all the stages one at a time, so no
+ * arrays are made in between. Sequences don't change, the position of a
+ * pass is kept in iterators, so a sequence can be used again. Lines of a
+ * file are used up when read though.
+ */
+typedef enum KSeqKind {
+  SEQ_RANGE,  // integers from up to but not including to
+  SEQ_ITEMS,  // items of src
+  SEQ_MAP,    // results of code for the items of src
+  SEQ_FILTER, // items of src for which code is truthy
+  SEQ_TAKE,   // first to items of src
+} KSeqKind;
+
+struct KSeq {
+  KSeqKind kind;
+  KVal src; // a sequence for the stages
+  KVal code;
+  int64_t from, to;
+};
+
+typedef struct KIter {
+  KSeq *seq;
+  struct KIter *src; // iterator of the source of a stage
+  int64_t pos;
+} KIter;
+
+KVal seq_val(KSeq *s) { return (KVal){.type = KT_SEQ, .data.seq = s}; }
+
+KSeq *seq_new(KSeqKind kind, KVal src) {
+  KSeq *s = alloc_node(sizeof(KSeq));
+  s->kind = kind;
+  s->src = src;
+  return s;
+}
+
+/* v as a sequence, NULL if it has no items */
+KSeq *seq_of(KVal v) {
+  switch (v.type) {
+  case KT_SEQ:
+    return v.data.seq;
+  case KT_ARRAY:
+  case KT_STRING:
+  case KT_VECTOR:
+  case KT_FILE:
+    return seq_new(SEQ_ITEMS, v);
+  default:
+    return NULL;
+  }
+}
+
+/* Iterators are collected blocks, the collector sees the sequences
+ * through them while they are used.
+ */
+KIter *iter_new(KSeq *seq) {
+  KIter *it = alloc_node(sizeof(KIter));
+  it->seq = seq;
+  it->pos = seq->kind == SEQ_RANGE ? seq->from : 0;
+  if (seq->kind >= SEQ_MAP)
+    it->src = iter_new(seq->src.data.seq);
+  return it;
+}
+
+bool items_next(KIter *it, KVal *out) {
+  KVal *src = &it->seq->src;
+  size_t i = (size_t)it->pos;
+  switch (src->type) {
+  case KT_ARRAY:
+    if (i >= src->data.array->size)
+      return false;
+    *out = src->data.array->items[i];
+    break;
+  case KT_STRING: {
+    KString s = kval_str(src);
+    if (i >= s.len)
+      return false;
+    *out = int_val(s.data[i]);
+    break;
+  }
+  case KT_VECTOR:
+    if (i >= src->data.vector->size)
+      return false;
+    *out = vec_get(src->data.vector, i);
+    break;
+  case KT_FILE:
+    return file_line(src->data.file, out);
+  default:
+    return false;
+  }
+  it->pos++;
+  return true;
+}
+
+/* Next item of the sequence to out, false when there are no more */
+bool iter_next(KCtx *ctx, KIter *it, KVal *out) {
+  KSeq *s = it->seq;
+  switch (s->kind) {
+  case SEQ_RANGE:
+    if (it->pos >= s->to)
+      return false;
+    *out = int_val(it->pos++);
+    return true;
+  case SEQ_ITEMS:
+    return items_next(it, out);
+  case SEQ_MAP:
+    if (!iter_next(ctx, it->src, out))
+      return false;
+    stack_push(ctx->stack, *out);
+    exec(ctx, s->code);
+    *out = stack_pop(ctx->stack);
+    return true;
+  case SEQ_FILTER:
+    while (iter_next(ctx, it->src, out)) {
+      stack_push(ctx->stack, *out);
+      exec(ctx, s->code);
+      if (!falsy(stack_pop(ctx->stack)))
+        return true;
+    }
+    return false;
+  case SEQ_TAKE:
+    if (it->pos >= s->to)
+      return false;
+    it->pos++;
+    return iter_next(ctx, it->src, out);
+  }
+  return false;
+}
+
+/* Stage of kind taking the items of src, error if src has none */
+KVal seq_stage(KSeqKind kind, KVal src, KVal code, int64_t n) {
+  KSeq *from = seq_of(src);
+  KVal ret;
+  if (!from) {
+    err(ret, "Expected array, string, vector, file or sequence");
+    return ret;
+  }
+  KSeq *s = seq_new(kind, seq_val(from));
+  s->code = code;
+  s->to = n;
+  return seq_val(s);
+}
+
+/* (from to -- seq)
+ * integers from up to but not including to
+ */
+void native_range(KCtx *ctx) {
+  IN_NUM(to);
+  IN_NUM(from);
+  KSeq *s = seq_new(SEQ_RANGE, (KVal){.type = KT_NIL});
+  s->from = kval_int(from);
+  s->to = kval_int(to);
+  OUT(seq_val(s));
+}
+
+/* (items -- seq)
+ * items of array, string, vector or lines of file as a sequence
+ */
+void native_seq(KCtx *ctx) {
+  IN_ANY(src);
+  KSeq *s = seq_of(src);
+  KVal ret;
+  if (s)
+    ret = seq_val(s);
+  else
+    err(ret, "Expected array, string, vector, file or sequence");
+  OUT(ret);
+}
+
+/* (items code -- seq)
+ * results of code for each item, run when the items are used
+ */
+void native_map(KCtx *ctx) {
+  IN_EXEC(code);
+  IN_ANY(src);
+  OUT(seq_stage(SEQ_MAP, src, code, 0));
+}
+
+/* (items n -- seq)
+ * first n items
+ */
+void native_take(KCtx *ctx) {
+  IN_NUM(n);
+  IN_ANY(src);
+  OUT(seq_stage(SEQ_TAKE, src, (KVal){.type = KT_NIL}, kval_int(n)));
+}
+
+/* (items -- arr)
+ * array of the items
+ */
+void native_into_array(KCtx *ctx) {
+  IN_ANY(src);
+  KSeq *s = seq_of(src);
+  KVal ret;
+  if (!s) {
+    err(ret, "Expected array, string, vector, file or sequence");
+    stack_push(ctx->stack, ret);
     return;
   }
-  snprintf(filename, 512, "%.*s", (int)name.data.string.len,
-           name.data.string.data);
-  struct stat b;
-  stat(filename, &b);
-  FILE* f = fopen(filename, "r");
-  char* in = (char*) tgc_alloc(&gc, b.st_size+1);
-  fread(in, b.st_size, 1, f);
-  in[b.st_size] = 0;
-  fclose(f);
-  arr_push(ctx->stack, (KVal){.type = KT_STRING,
-                              .data.string = {.len = b.st_size, .data = in}});
+  KArray *arr = arr_new(0);
+  KIter *it = iter_new(s);
+  KVal item;
+  while (iter_next(ctx, it, &item))
+    arr_push(arr, item);
+  stack_push(ctx->stack, (KVal){.type = KT_ARRAY, .data.array = arr});
 }
 
 /* Takes 2 values: an array to process and code (array or word name) to run on each item.
@@ -871,65 +3363,86 @@ void native_slurp(KCtx *ctx) {
  */
 
 void native_each(KCtx *ctx) {
-  KVal code = arr_pop(ctx->stack);
-  if(code.type == KT_ARRAY) code.type = KT_BLOCK;
-  KVal arr = arr_pop(ctx->stack);
+  IN_EXEC(code);
+  KVal arr = stack_pop(ctx->stack);
   KVal error;
   if(arr.type == KT_ARRAY) {
+    arr_modified(arr.data.array);
     for (size_t i = 0; i < arr.data.array->size; i++) {
       KVal item = arr.data.array->items[i];
-      arr_push(ctx->stack, item);
+      stack_push(ctx->stack, item);
       exec(ctx, code);
-      arr.data.array->items[i] = arr_pop(ctx->stack);
+      arr_write(arr.data.array);
+      arr.data.array->items[i] = stack_pop(ctx->stack);
     }
   } else if (arr.type == KT_STRING) {
-    for (size_t i = 0; i < arr.data.string.len; i++) {
-      KVal byte = (KVal){.type = KT_NUMBER,
-                         .data.number = (double)arr.data.string.data[i]};
-      arr_push(ctx->stack, byte);
+    // results go to a new string, the original may be shared
+    KString in = kval_str(&arr);
+    KVal res;
+    char *out = str_alloc(&res, in.len);
+    for (size_t i = 0; i < in.len; i++) {
+      KVal byte = int_val(in.data[i]);
+      stack_push(ctx->stack, byte);
       exec(ctx, code);
-      KVal v = arr_pop(ctx->stack);
-      if (v.type != KT_NUMBER) {
+      KVal v = stack_pop(ctx->stack);
+      if (!is_number(v)) {
         err(error, "Can't store non-number value to string index: %zu", i);
         goto error;
       }
-      arr.data.string.data[i] = (char) v.data.number;
+      out[i] = (char)kval_int(v);
     }
+    arr = res;
+  } else if (arr.type == KT_SEQ) {
+    // nothing to store the results to, the code runs like for each-line
+    KIter *it = iter_new(arr.data.seq);
+    KVal item;
+    while (iter_next(ctx, it, &item)) {
+      stack_push(ctx->stack, item);
+      exec(ctx, code);
+    }
+    return;
   } else {
-    err(error, "Expected array or string to go through");
+    err(error, "Expected array, string or sequence to go through");
     goto error;
   }
 
-  arr_push(ctx->stack, arr);
+  stack_push(ctx->stack, arr);
   return;
 
   error:
-  arr_push(ctx->stack, error);
+  stack_push(ctx->stack, error);
 }
 
 void fold(KCtx *ctx, bool init) {
-  KVal code = arr_pop(ctx->stack);
-  if(code.type == KT_ARRAY) code.type = KT_BLOCK;
-  KVal arr = arr_pop(ctx->stack);
+  IN_EXEC(code);
+  KVal arr = stack_pop(ctx->stack);
   KVal error;
   if(arr.type == KT_ARRAY) {
     for (size_t i = 0; i < arr.data.array->size; i++) {
       KVal item = arr.data.array->items[i];
-      arr_push(ctx->stack, item);
+      stack_push(ctx->stack, item);
       if(i || init)
         exec(ctx, code);
     }
   } else if (arr.type == KT_STRING) {
-    for (size_t i = 0; i < arr.data.string.len; i++) {
-      KVal item =
-          (KVal){.type = KT_NUMBER, .data.number = arr.data.string.data[i]};
-      arr_push(ctx->stack, item);
+    KString s = kval_str(&arr);
+    for (size_t i = 0; i < s.len; i++) {
+      KVal item = int_val(s.data[i]);
+      stack_push(ctx->stack, item);
+      if(i || init)
+        exec(ctx, code);
+    }
+  } else if (arr.type == KT_SEQ) {
+    KIter *it = iter_new(arr.data.seq);
+    KVal item;
+    for (size_t i = 0; iter_next(ctx, it, &item); i++) {
+      stack_push(ctx->stack, item);
       if(i || init)
         exec(ctx, code);
     }
   } else {
-    err(error, "Expected array or string to fold");
-    arr_push(ctx->stack, error);
+    err(error, "Expected array, string or sequence to fold");
+    stack_push(ctx->stack, error);
   }
 }
 
@@ -947,70 +3460,201 @@ void native_foldi(KCtx *ctx) { fold(ctx, true); }
  */
 void native_while(KCtx *ctx) {
   IN_EXEC(loop);
+  KCode *body = loop_code(ctx, loop);
   for (;;) {
-    exec(ctx, loop);
-    IN_ANY(condition);
+    if (body) {
+      gc_safepoint(ctx);
+      run(ctx, body);
+    } else {
+      exec(ctx, loop);
+    }
+    KVal condition = stack_pop(ctx->stack);
     if(falsy(condition)) return;
   }
 }
 
 bool is_uint8_num(KVal n) {
-  return n.type == KT_NUMBER && (long) n.data.number >= 0 &&
-    (long) n.data.number <= 255;
+  return is_number(n) && kval_int(n) >= 0 && kval_int(n) <= 255;
 }
 
 void native_cat(KCtx *ctx) {
-  KVal b = arr_pop(ctx->stack);
-  KVal a = arr_pop(ctx->stack);
+  KVal b = stack_pop(ctx->stack);
+  KVal a = stack_pop(ctx->stack);
   KVal error;
+  KVal str;
   if (b.type == KT_STRING && a.type == KT_STRING) {
-    size_t len = a.data.string.len + b.data.string.len;
-    KVal str = (KVal) {
-      .type = KT_STRING, .data.string = {
-        .len = len,
-        .data = tgc_alloc(&gc, len)
-      }
-    };
-    memcpy(str.data.string.data, a.data.string.data, a.data.string.len);
-    memcpy(&str.data.string.data[a.data.string.len], b.data.string.data, b.data.string.len);
+    KString as = kval_str(&a), bs = kval_str(&b);
+    char *data = str_alloc(&str, as.len + bs.len);
+    memcpy(data, as.data, as.len);
+    memcpy(data + as.len, bs.data, bs.len);
     OUT(str);
   } else if (a.type == KT_STRING && is_uint8_num(b)) {
     // append char to a
-    size_t len = a.data.string.len + 1;
-    KVal str = (KVal){.type = KT_STRING,
-                      .data.string = {.len = len, .data = tgc_alloc(&gc, len)}};
-    memcpy(str.data.string.data, a.data.string.data, len - 1);
-    str.data.string.data[len-1] = (uint8_t) b.data.number;
+    KString as = kval_str(&a);
+    char *data = str_alloc(&str, as.len + 1);
+    memcpy(data, as.data, as.len);
+    data[as.len] = (uint8_t)kval_int(b);
     OUT(str);
   } else if (is_uint8_num(a) && b.type == KT_STRING) {
     // prepend char to b
-    size_t len = b.data.string.len + 1;
-    KVal str = (KVal){.type = KT_STRING,
-                      .data.string = {.len = len, .data = tgc_alloc(&gc, len)}};
-    str.data.string.data[0] = (uint8_t)a.data.number;
-    memcpy(&str.data.string.data[1], b.data.string.data, len - 1);
+    KString bs = kval_str(&b);
+    char *data = str_alloc(&str, bs.len + 1);
+    data[0] = (uint8_t)kval_int(a);
+    memcpy(data + 1, bs.data, bs.len);
     OUT(str);
   } else {
     err(error, "Expected two strings or a string and a number (0-255) to join");
-    arr_push(ctx->stack, error);
+    stack_push(ctx->stack, error);
+  }
+
+}
+
+/* String scanning uses memchr, which libc implements with vector
+ * instructions, and the results are slices of the input string.
+ */
+
+/* (str ch -- str idx)
+ * index of first ch in str, -1 if not found
+ */
+void native_ch_idx(KCtx *ctx) {
+  IN_NUM(ch);
+  IN(str, KT_STRING);
+  KString s = kval_str(&str);
+  char *at = memchr(s.data, (int)kval_int(ch), s.len);
+  OUT(str);
+  OUT(int_val(at ? at - s.data : -1));
+}
+
+/* (str ch -- str1 str2)
+ * split string at first ch, str2 is empty if there is no ch
+ */
+void native_split_at(KCtx *ctx) {
+  IN_NUM(ch);
+  IN(str, KT_STRING);
+  KString s = kval_str(&str);
+  char *at = memchr(s.data, (int)kval_int(ch), s.len);
+  if (!at) {
+    OUT(str);
+    OUT(str_slice(&str, s.len, s.len));
+    return;
+  }
+  size_t idx = at - s.data;
+  OUT(str_slice(&str, 0, idx));
+  OUT(str_slice(&str, idx + 1, s.len));
+}
+
+size_t count_ch(KString s, char ch) {
+  size_t n = 0;
+  char *at = s.data, *end = s.data + s.len;
+  while ((at = memchr(at, ch, end - at))) {
+    n++;
+    at++;
+  }
+  return n;
+}
+
+/* (str -- arr)
+ * split string to array of lines, a newline at the end doesn't start
+ * another line
+ */
+void native_lines(KCtx *ctx) {
+  IN(str, KT_STRING);
+  KString s = kval_str(&str);
+  KArray *arr = arr_new(count_ch(s, '\n') + 1);
+  size_t start = 0;
+  char *at;
+  while ((at = memchr(s.data + start, '\n', s.len - start))) {
+    size_t end = at - s.data;
+    arr->items[arr->size++] = str_slice(&str, start, end);
+    start = end + 1;
+  }
+  if (start < s.len || arr->size == 0)
+    arr->items[arr->size++] = str_slice(&str, start, s.len);
+  OUT(((KVal){.type = KT_ARRAY, .data.array = arr}));
+}
+
+/* (str sep -- arr)
+ * split string by separator into array of tokens
+ */
+void native_split(KCtx *ctx) {
+  IN(sep, KT_STRING);
+  IN(str, KT_STRING);
+  KString s = kval_str(&str), p = kval_str(&sep);
+  if (p.len == 0) {
+    KVal error;
+    err(error, "Expected non empty separator to split by");
+    OUT(error);
+    return;
+  }
+  KArray *arr = arr_new(count_ch(s, p.data[0]) + 1);
+  size_t start = 0, i = 0;
+  char *at;
+  while (i + p.len <= s.len &&
+         (at = memchr(s.data + i, p.data[0], s.len - i - p.len + 1))) {
+    i = at - s.data;
+    if (memcmp(at, p.data, p.len) == 0) {
+      arr->items[arr->size++] = str_slice(&str, start, i);
+      i += p.len;
+      start = i;
+    } else {
+      i++;
+    }
   }
+  arr->items[arr->size++] = str_slice(&str, start, s.len);
+  OUT(((KVal){.type = KT_ARRAY, .data.array = arr}));
+}
 
+/* (arr str -- str)
+ * join array of strings with separator
+ */
+void native_join(KCtx *ctx) {
+  IN(sep, KT_STRING);
+  IN(arr, KT_ARRAY);
+  KArray *a = arr.data.array;
+  KString p = kval_str(&sep);
+  size_t len = a->size ? p.len * (a->size - 1) : 0;
+  for (size_t i = 0; i < a->size; i++) {
+    if (a->items[i].type != KT_STRING) {
+      KVal error;
+      err(error, "Expected array of strings to join");
+      OUT(error);
+      return;
+    }
+    len += kval_str(&a->items[i]).len;
+  }
+  KVal str;
+  char *at = str_alloc(&str, len);
+  for (size_t i = 0; i < a->size; i++) {
+    if (i) {
+      memcpy(at, p.data, p.len);
+      at += p.len;
+    }
+    KString s = kval_str(&a->items[i]);
+    memcpy(at, s.data, s.len);
+    at += s.len;
+  }
+  OUT(str);
 }
 
 int kval_compare(const void *Aptr, const void *Bptr) {
   KVal a = *((KVal *)Aptr);
   KVal b = *((KVal *)Bptr);
+  if (a.type == KT_INT && b.type == KT_INT) {
+    return a.data.integer < b.data.integer
+               ? -1
+               : (a.data.integer > b.data.integer ? 1 : 0);
+  } else if (is_number(a) && is_number(b)) {
+    double x = kval_number(a), y = kval_number(b);
+    return x < y ? -1 : (x > y ? 1 : 0);
+  }
   if (a.type != b.type) {
     return a.type - b.type;
   }
   switch (a.type) {
-  case KT_NUMBER:
-    return a.data.number < b.data.number
-               ? -1
-               : (a.data.number > b.data.number ? 1 : 0);
   case KT_STRING: {
-    size_t al = a.data.string.len, bl = b.data.string.len;
-    int ord = memcmp(a.data.string.data, b.data.string.data, al < bl ? al : bl);
+    KString as = kval_str(&a), bs = kval_str(&b);
+    size_t al = as.len, bl = bs.len;
+    int ord = memcmp(as.data, bs.data, al < bl ? al : bl);
     if (ord == 0) {
       return al - bl;
     } else {
@@ -1035,30 +3679,215 @@ int kval_compare(const void *Aptr, const void *Bptr) {
   }
 }
 
+/* Sorting
+ *
+ * Items are sorted by their keys, for sort each item is its own key. When
+ * all keys are numbers the items are radix sorted on bits that order like
+ * the numbers. When all keys are strings their first bytes are cached in
+ * the bits, so most comparisons don't need to look at the strings. Other
+ * keys are compared with kval_compare.
+ */
+#define KOKOKI_RADIX_MIN 64 // fewer items are sorted with qsort
+
+typedef struct KSortItem {
+  uint64_t bits; // orders like the key when they differ
+  KVal *key;     // also tells the index of the item
+} KSortItem;
+
+uint64_t int_bits(int64_t i) { return (uint64_t)i ^ (UINT64_C(1) << 63); }
+
+uint64_t number_bits(double d) {
+  uint64_t u;
+  memcpy(&u, &d, sizeof(u));
+  return u >> 63 ? ~u : u | (UINT64_C(1) << 63);
+}
+
+/* First bytes of string, big endian so that they order like memcmp */
+uint64_t prefix_bits(KVal *v) {
+  KString s = kval_str(v);
+  uint64_t bits = 0;
+  for (size_t i = 0; i < sizeof(bits); i++)
+    bits = bits << 8 | (i < s.len ? (uint8_t)s.data[i] : 0);
+  return bits;
+}
+
+int sort_item_compare(const void *a, const void *b) {
+  const KSortItem *x = a, *y = b;
+  if (x->bits != y->bits)
+    return x->bits < y->bits ? -1 : 1;
+  return kval_compare(x->key, y->key);
+}
+
+/* Stable LSD radix sort on bits a byte at a time, skipping bytes that are
+ * the same in all items. Returns items or tmp, whichever has the result.
+ */
+KSortItem *radix_sort(KSortItem *items, KSortItem *tmp, size_t n) {
+  size_t counts[8][256] = {{0}};
+  for (size_t i = 0; i < n; i++)
+    for (int d = 0; d < 8; d++)
+      counts[d][items[i].bits >> (d * 8) & 0xff]++;
+  for (int d = 0; d < 8; d++) {
+    size_t *c = counts[d];
+    if (c[items[0].bits >> (d * 8) & 0xff] == n)
+      continue;
+    size_t sum = 0;
+    for (int k = 0; k < 256; k++) {
+      size_t count = c[k];
+      c[k] = sum;
+      sum += count;
+    }
+    for (size_t i = 0; i < n; i++)
+      tmp[c[items[i].bits >> (d * 8) & 0xff]++] = items[i];
+    KSortItem *t = items;
+    items = tmp;
+    tmp = t;
+  }
+  return items;
+}
+
+/* Sort n vals by keys, keys may be vals. Nothing is allocated from the
+ * heap, so the values in the arena don't need to be seen by the collector.
+ * The items are kept small as moving them is most of the work.
+ */
+void sort_keyed(KCtx *ctx, KVal *vals, KVal *keys, size_t n) {
+  bool ints = true, numbers = true, strings = true;
+  for (size_t i = 0; i < n; i++) {
+    ints = ints && keys[i].type == KT_INT;
+    numbers = numbers && is_number(keys[i]);
+    strings = strings && keys[i].type == KT_STRING;
+  }
+  KArenaMark mark = arena_mark(ctx);
+  KSortItem *items = arena_alloc(ctx, n * sizeof(KSortItem));
+  for (size_t i = 0; i < n; i++) {
+    KVal *k = &keys[i];
+    uint64_t bits = ints      ? int_bits(k->data.integer)
+                    : numbers ? number_bits(kval_number(*k))
+                    : strings ? prefix_bits(k)
+                              : 0;
+    items[i] = (KSortItem){.bits = bits, .key = k};
+  }
+  if (numbers && n >= KOKOKI_RADIX_MIN)
+    items = radix_sort(items, arena_alloc(ctx, n * sizeof(KSortItem)), n);
+  else
+    qsort(items, n, sizeof(KSortItem), sort_item_compare);
+  KVal *sorted = arena_alloc(ctx, n * sizeof(KVal));
+  for (size_t i = 0; i < n; i++)
+    sorted[i] = vals[items[i].key - keys];
+  if (n)
+    memcpy(vals, sorted, n * sizeof(KVal));
+  arena_release(ctx, mark);
+}
+
 void native_sort(KCtx *ctx) {
   IN(arr, KT_ARRAY);
-  qsort(arr.data.array->items, arr.data.array->size, sizeof(KVal),
-        kval_compare);
+  KArray *a = arr.data.array;
+  arr_modified(a);
+  sort_keyed(ctx, a->items, a->items, a->size);
   OUT(arr);
 }
 
+/* [items] [key] sort-by
+ * sort items by the keys that the code computes for them, the code is run
+ * once for each item
+ */
+void native_sort_by(KCtx *ctx) {
+  IN_EXEC(code);
+  IN(arr, KT_ARRAY);
+  KArray *a = arr.data.array;
+  KArray *keys = arr_new(a->size);
+  for (size_t i = 0; i < a->size; i++) {
+    stack_push(ctx->stack, a->items[i]);
+    exec(ctx, code);
+    arr_push(keys, stack_pop(ctx->stack));
+  }
+  arr_modified(a);
+  sort_keyed(ctx, a->items, keys->items,
+             keys->size < a->size ? keys->size : a->size);
+  stack_push(ctx->stack, arr);
+}
+
+/* Keep the items of array or vector where mask is not 0 */
+void filter_mask(KCtx *ctx, KVal arr, KVector *mask) {
+  KVal error;
+  size_t n = arr.type == KT_ARRAY    ? arr.data.array->size
+             : arr.type == KT_VECTOR ? arr.data.vector->size
+                                     : 0;
+  if (arr.type != KT_ARRAY && arr.type != KT_VECTOR) {
+    err(error, "Expected array or vector to filter");
+    stack_push(ctx->stack, error);
+    return;
+  }
+  if (n != mask->size) {
+    err(error, "Mask has %zu items for %zu", mask->size, n);
+    stack_push(ctx->stack, error);
+    return;
+  }
+  size_t idx = 0;
+  if (arr.type == KT_VECTOR) {
+    int64_t *items = arr.data.vector->items.ints; // doubles are moved as is
+    for (size_t i = 0; i < n; i++) {
+      if (kval_number(vec_get(mask, i)) != 0)
+        items[idx++] = items[i];
+    }
+    arr.data.vector->size = idx;
+  } else {
+    KArray *a = arr.data.array;
+    arr_modified(a);
+    for (size_t i = 0; i < n; i++) {
+      if (kval_number(vec_get(mask, i)) != 0)
+        a->items[idx++] = a->items[i];
+    }
+    for (size_t i = idx; i < n; i++)
+      a->items[i] = (KVal){.type = KT_NIL};
+    a->size = idx;
+  }
+  stack_push(ctx->stack, arr);
+}
+
+/* Keep the numbers of vector for which code leaves a truthy value */
+void filter_vec(KCtx *ctx, KVector *v, KVal code) {
+  size_t idx = 0;
+  for (size_t i = 0; i < v->size; i++) {
+    KVal item = vec_get(v, i);
+    stack_push(ctx->stack, item);
+    exec(ctx, code);
+    if (!falsy(stack_pop(ctx->stack)))
+      vec_set(v, idx++, item);
+  }
+  v->size = idx;
+  stack_push(ctx->stack, vec_val(v));
+}
+
 void native_filter(KCtx *ctx) {
- KVal code = arr_pop(ctx->stack);
- if(code.type == KT_ARRAY) code.type = KT_BLOCK;
- KVal arr = arr_pop(ctx->stack);
+ IN_EXEC(code);
+ KVal arr = stack_pop(ctx->stack);
  KVal error;
+ if (code.type == KT_VECTOR) {
+   filter_mask(ctx, arr, code.data.vector);
+   return;
+ }
+ if (arr.type == KT_VECTOR) {
+   filter_vec(ctx, arr.data.vector, code);
+   return;
+ }
+ if (arr.type == KT_SEQ) {
+   stack_push(ctx->stack, seq_stage(SEQ_FILTER, arr, code, 0));
+   return;
+ }
  if (arr.type != KT_ARRAY) {
    err(error, "Expected array to filter");
-   arr_push(ctx->stack, error);
+   stack_push(ctx->stack, error);
    return;
  }
+ arr_modified(arr.data.array);
  size_t idx=0; // idx to put to
  for (size_t i = 0; i < arr.data.array->size; i++) {
    KVal item = arr.data.array->items[i];
-   arr_push(ctx->stack, item);
+   stack_push(ctx->stack, item);
    exec(ctx, code);
-   KVal result = arr_pop(ctx->stack);
+   KVal result = stack_pop(ctx->stack);
    if (result.type != KT_FALSE && result.type != KT_NIL) {
+     arr_write(arr.data.array);
      arr.data.array->items[idx++] = item;
    }
  }
@@ -1067,20 +3896,302 @@ void native_filter(KCtx *ctx) {
    arr.data.array->items[i] = (KVal){.type = KT_NIL};
  }
  arr.data.array->size = idx;
- arr_push(ctx->stack, arr);
+ stack_push(ctx->stack, arr);
+}
+
+/* Parallel each, filter and fold. The array is split into chunks that
+ * worker threads take in turn, so threads that finish early pick up more
+ * of the work. The workers are started by the first parallel word of an
+ * instance and wait for the next job until the instance is freed. Each
+ * worker runs the code with its own stacks, sharing the dictionary.
+ * Allocations of all threads go through the heap lock, so code that
+ * allocates for each item gains less. The code must not change values
+ * shared between items.
+ * Results are stored in order, preduce combines the chunk results
+ * left to right so the code must be associative.
+ *
+ * Small arrays, nested parallel words and builds without KOKOKI_THREADS
+ * run sequentially.
+ */
+#define KOKOKI_PARALLEL_MIN 1024 // smaller arrays aren't worth the threads
+
+typedef enum KParallel { PAR_EACH, PAR_FILTER, PAR_REDUCE } KParallel;
+
+typedef struct KJob {
+  KParallel kind;
+  KVal code;
+  KArray *arr;
+  size_t chunk, nchunks;
+  size_t next;   // next chunk to take
+  bool *keep;    // filter result for each item
+  KVal *results; // reduce result for each chunk
+} KJob;
+
+void run_chunk(KJob *job, KCtx *ctx, size_t c) {
+  size_t start = c * job->chunk;
+  size_t end = start + job->chunk;
+  KVal *items = job->arr->items;
+  if (end > job->arr->size)
+    end = job->arr->size;
+  for (size_t i = start; i < end; i++) {
+    stack_push(ctx->stack, items[i]);
+    if (job->kind != PAR_REDUCE || i > start)
+      exec(ctx, job->code);
+    if (job->kind == PAR_EACH)
+      items[i] = stack_pop(ctx->stack);
+    else if (job->kind == PAR_FILTER)
+      job->keep[i] = !falsy(stack_pop(ctx->stack));
+  }
+  if (job->kind == PAR_REDUCE)
+    job->results[c] = stack_pop(ctx->stack);
+}
+
+#ifdef KOKOKI_THREADS
+typedef struct KPool KPool;
+
+typedef struct KWorker {
+  pthread_t thread;
+  KPool *pool;
+  KCtx *ctx;
+} KWorker;
+
+/* Worker threads of an instance */
+struct KPool {
+  size_t nworkers;
+  KWorker *workers;
+  pthread_mutex_t lock;
+  pthread_cond_t start, done;
+  KJob *job;      // job to work on
+  uint64_t round; // counts jobs, workers wait for it to change
+  size_t busy;    // workers still working on the job
+  bool stop;      // the instance is freed
+};
+
+void work(KJob *job, KCtx *ctx) {
+  size_t c;
+  while ((c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+         job->nchunks)
+    run_chunk(job, ctx, c);
+}
+
+void *worker_main(void *ptr) {
+  KWorker *w = ptr;
+  KPool *pool = w->pool;
+  heap = w->ctx->heap;
+  uint64_t round = 0;
+  LOCK(pool->lock);
+  for (;;) {
+    while (!pool->stop && pool->round == round)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    if (pool->stop)
+      break;
+    round = pool->round;
+    KJob *job = pool->job;
+    UNLOCK(pool->lock);
+    work(job, w->ctx);
+    LOCK(pool->lock);
+    if (--pool->busy == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  UNLOCK(pool->lock);
+  return NULL;
+}
+
+/* Context for a worker thread, shares the dictionary and loaded modules
+ * of ctx. Workers don't profile and print straight to stdout. The context
+ * is a root, as the collector runs between jobs.
+ */
+KCtx *worker_ctx(KCtx *ctx) {
+  LOCK(heap->lock);
+  KCtx *w = tgc_calloc_opt(&heap->gc, 1, sizeof(KCtx), TGC_ROOT, NULL);
+  UNLOCK(heap->lock);
+  w->heap = ctx->heap;
+  w->names = ctx->names;
+  w->symbols = ctx->symbols;
+  w->modules = ctx->modules;
+  w->stack = alloc_node(sizeof(KStack));
+  w->stack->capacity = ctx->stack->capacity;
+  w->stack->items = alloc_vals(w->stack->capacity);
+  w->rstack = NULL;
+  w->rsize = w->rcapacity = 0;
+  w->tail = (KVal){.type = KT_NIL};
+  w->arena = NULL;
+  w->threads = ctx->threads;
+  w->profiling = false;
+  w->profile = NULL;
+  w->out = (KOut){0};
+  return w;
+}
+
+/* Start threads - 1 workers, the thread running a job works on it too */
+KPool *pool_new(KCtx *ctx, size_t threads) {
+  KPool *pool = calloc(1, sizeof(KPool));
+  pool->workers = malloc((threads - 1) * sizeof(KWorker));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (size_t i = 0; i < threads - 1; i++) {
+    KWorker *w = &pool->workers[pool->nworkers];
+    *w = (KWorker){.pool = pool, .ctx = worker_ctx(ctx)};
+    if (pthread_create(&w->thread, NULL, worker_main, w) == 0)
+      pool->nworkers++;
+  }
+  return pool;
+}
+
+void pool_free(KPool *pool) {
+  LOCK(pool->lock);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->start);
+  UNLOCK(pool->lock);
+  for (size_t i = 0; i < pool->nworkers; i++)
+    pthread_join(pool->workers[i].thread, NULL);
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->start);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->workers);
+  free(pool);
+}
+
+bool run_parallel(KCtx *ctx, KJob *job) {
+  size_t threads = ctx->threads;
+  if (!threads) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? (size_t)cores : 1;
+  }
+  if (threads < 2 || job->arr->size < KOKOKI_PARALLEL_MIN ||
+      __atomic_exchange_n(&heap->parallel, true, __ATOMIC_ACQUIRE))
+    return false;
+  if (!heap->pool)
+    heap->pool = pool_new(ctx, threads);
+  KPool *pool = heap->pool;
+  threads = pool->nworkers + 1;
+  job->chunk = job->arr->size / (threads * 8);
+  if (job->chunk < KOKOKI_PARALLEL_MIN / 8)
+    job->chunk = KOKOKI_PARALLEL_MIN / 8;
+  job->nchunks = (job->arr->size + job->chunk - 1) / job->chunk;
+  if (job->kind == PAR_FILTER)
+    job->keep = malloc(job->arr->size * sizeof(bool));
+  if (job->kind == PAR_REDUCE)
+    job->results = alloc_vals(job->nchunks);
+  // compile before starting, so workers share the code
+  if (job->code.type == KT_BLOCK)
+    block_code(ctx, job->code.data.array);
+
+  // nothing is collected while other threads use values
+  LOCK(heap->lock);
+  tgc_pause(&heap->gc);
+  UNLOCK(heap->lock);
+  LOCK(pool->lock);
+  pool->job = job;
+  pool->busy = pool->nworkers;
+  pool->round++;
+  pthread_cond_broadcast(&pool->start);
+  UNLOCK(pool->lock);
+  work(job, ctx);
+  LOCK(pool->lock);
+  while (pool->busy)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pool->job = NULL;
+  UNLOCK(pool->lock);
+  for (size_t i = 0; i < pool->nworkers; i++) {
+    // values left by unbalanced code aren't kept for the next job
+    pool->workers[i].ctx->stack->size = 0;
+    kokoki_arena_reset(pool->workers[i].ctx);
+  }
+  LOCK(heap->lock);
+  tgc_resume(&heap->gc);
+  UNLOCK(heap->lock);
+  __atomic_store_n(&heap->parallel, false, __ATOMIC_RELEASE);
+  return true;
+}
+#else
+bool run_parallel(KCtx *ctx, KJob *job) { return false; }
+#endif
+
+/* (arr code -- arr)
+ * each that runs the code for items on several threads
+ */
+void native_peach(KCtx *ctx) {
+  KVal arr = ctx->stack->items[ctx->stack->size - 2];
+  KJob job = {.kind = PAR_EACH, .code = code_block(ctx, TOP())};
+  if (arr.type != KT_ARRAY) {
+    native_each(ctx);
+    return;
+  }
+  job.arr = arr.data.array;
+  arr_modified(job.arr);
+  if (!run_parallel(ctx, &job)) {
+    native_each(ctx);
+    return;
+  }
+  ctx->stack->size--; // code
+}
+
+/* (arr code -- arr)
+ * filter that runs the code for items on several threads
+ */
+void native_pfilter(KCtx *ctx) {
+  KVal arr = ctx->stack->items[ctx->stack->size - 2];
+  KJob job = {.kind = PAR_FILTER, .code = code_block(ctx, TOP())};
+  if (arr.type != KT_ARRAY) {
+    native_filter(ctx);
+    return;
+  }
+  job.arr = arr.data.array;
+  if (!run_parallel(ctx, &job)) {
+    native_filter(ctx);
+    return;
+  }
+  ctx->stack->size--; // code
+  KArray *a = job.arr;
+  arr_modified(a);
+  size_t idx = 0;
+  for (size_t i = 0; i < a->size; i++) {
+    if (job.keep[i])
+      a->items[idx++] = a->items[i];
+  }
+  for (size_t i = idx; i < a->size; i++)
+    a->items[i] = (KVal){.type = KT_NIL};
+  a->size = idx;
+  free(job.keep);
+}
+
+/* (arr code -- result)
+ * fold that runs the code on chunks of the array on several threads
+ */
+void native_preduce(KCtx *ctx) {
+  KVal arr = ctx->stack->items[ctx->stack->size - 2];
+  KJob job = {.kind = PAR_REDUCE, .code = code_block(ctx, TOP())};
+  if (arr.type != KT_ARRAY) {
+    native_fold(ctx);
+    return;
+  }
+  job.arr = arr.data.array;
+  if (!run_parallel(ctx, &job)) {
+    native_fold(ctx);
+    return;
+  }
+  ctx->stack->size -= 2; // code and arr
+  for (size_t c = 0; c < job.nchunks; c++) {
+    stack_push(ctx->stack, job.results[c]);
+    if (c)
+      exec(ctx, job.code);
+  }
 }
 
 void native_equals(KCtx *ctx) {
-  KVal b = arr_pop(ctx->stack);
-  KVal a = arr_pop(ctx->stack);
-  arr_push(ctx->stack, (KVal){.type = kval_eq(a, b) ? KT_TRUE : KT_FALSE});
+  KStack *s = ctx->stack;
+  KVal *a = &s->items[s->size - 2];
+  *a = bool_val(kval_eq(*a, a[1]));
+  s->size--;
 }
 
 void native_not(KCtx *ctx) {
-  if(falsy(arr_pop(ctx->stack))) {
-    arr_push(ctx->stack, (KVal){.type = KT_TRUE});
+  if(falsy(stack_pop(ctx->stack))) {
+    stack_push(ctx->stack, (KVal){.type = KT_TRUE});
   } else {
-    arr_push(ctx->stack, (KVal){.type = KT_FALSE});
+    stack_push(ctx->stack, (KVal){.type = KT_FALSE});
   }
 }
 
@@ -1094,19 +4205,24 @@ void native_apush(KCtx *ctx) {
   IN_ANY(v);
   IN(arr, KT_ARRAY);
   arr_push(arr.data.array, v);
-  arr_push(ctx->stack, arr);
+  stack_push(ctx->stack, arr);
 }
 
 void native_times(KCtx *ctx) {
   /* [code] N times
    * run code N times
    */
-  KVal times = arr_pop(ctx->stack);
-  KVal code = arr_pop(ctx->stack);
-  if(code.type == KT_ARRAY) code.type = KT_BLOCK;
-  long N = (long)times.data.number;
-  for (long i = 0; i < N; i++) {
-    exec(ctx, code);
+  KVal times = stack_pop(ctx->stack);
+  IN_EXEC(code);
+  int64_t N = kval_int(times);
+  KCode *body = loop_code(ctx, code);
+  for (int64_t i = 0; i < N; i++) {
+    if (body) {
+      gc_safepoint(ctx);
+      run(ctx, body);
+    } else {
+      exec(ctx, code);
+    }
   }
 }
 
@@ -1114,59 +4230,66 @@ void native_len(KCtx *ctx) {
   IN_ANY(arr);
   KVal len;
   if (arr.type == KT_ARRAY) {
-    len = (KVal){.type = KT_NUMBER, .data.number = arr.data.array->size};
+    len = int_val(arr.data.array->size);
   } else if (arr.type == KT_STRING) {
-    len = (KVal){.type = KT_NUMBER, .data.number = arr.data.string.len};
+    len = int_val(kval_str(&arr).len);
+  } else if (arr.type == KT_HASHMAP) {
+    len = int_val(arr.data.hashmap->size);
+  } else if (arr.type == KT_VECTOR) {
+    len = int_val(arr.data.vector->size);
   } else {
-    KVal len;
-    err(len, "Expected array or string for len");
+    err(len, "Expected array, string, vector or hashmap for len");
   }
   OUT(arr);
   OUT(len);
 }
 void native_aget(KCtx *ctx) {
-  KVal idx = arr_pop(ctx->stack);
-  KVal arr = arr_peek(ctx->stack);
+  KVal idx = stack_pop(ctx->stack);
+  KVal arr = TOP();
   KVal ret;
 
-  if (arr.type != KT_ARRAY && arr.type != KT_STRING) {
-    err(ret, "Expected array or string to get from");
-  } else if (idx.type != KT_NUMBER) {
+  if (arr.type != KT_ARRAY && arr.type != KT_STRING &&
+      arr.type != KT_VECTOR) {
+    err(ret, "Expected array, vector or string to get from");
+  } else if (!is_number(idx)) {
     err(ret, "Expected number index to get");
   } else {
-    size_t len =
-      arr.type == KT_ARRAY ? arr.data.array->size : arr.data.string.len;
-    size_t i = (size_t) idx.data.number;
+    KString s = arr.type == KT_STRING ? kval_str(&arr) : (KString){0};
+    size_t len = arr.type == KT_ARRAY    ? arr.data.array->size
+                 : arr.type == KT_VECTOR ? arr.data.vector->size
+                                         : s.len;
+    size_t i = (size_t)kval_int(idx);
     if (i < 0 || i >= len) {
       err(ret, "Index out of bounds %zu (0 - %zu inclusive)", i, len - 1);
     } else {
-      ret = arr.type == KT_ARRAY
-                ? arr.data.array->items[i]
-                : (KVal){.type = KT_NUMBER,
-                         .data.number = arr.data.string.data[i]};
+      ret = arr.type == KT_ARRAY    ? arr.data.array->items[i]
+            : arr.type == KT_VECTOR ? vec_get(arr.data.vector, i)
+                                    : int_val(s.data[i]);
     }
   }
-  arr_push(ctx->stack, ret);
+  stack_push(ctx->stack, ret);
 }
 
 void native_reverse(KCtx *ctx) {
   IN_ANY(arr);
   KVal error;
   if (arr.type == KT_STRING) {
-    size_t i = 0, j = arr.data.string.len-1;
-    while (i < j) {
-      char tmp = arr.data.string.data[i];
-      arr.data.string.data[i] = arr.data.string.data[j];
-      arr.data.string.data[j] = tmp;
-      i++; j--;
+    KString in = kval_str(&arr);
+    KVal res;
+    char *out = str_alloc(&res, in.len);
+    for (size_t i = 0; i < in.len; i++) {
+      out[i] = in.data[in.len - 1 - i];
     }
+    arr = res;
   } else if (arr.type == KT_ARRAY) {
-    size_t i = 0, j = arr.data.array->size - 1;
-    while (i < j) {
+    arr_modified(arr.data.array);
+    size_t i = 0, j = arr.data.array->size; // j is one past the item to swap
+    while (i + 1 < j) {
+      j--;
       KVal tmp = arr.data.array->items[i];
       arr.data.array->items[i] = arr.data.array->items[j];
       arr.data.array->items[j] = tmp;
-      i++; j--;
+      i++;
     }
   } else {
     err(error, "Expected string or array to reverse");
@@ -1176,60 +4299,142 @@ void native_reverse(KCtx *ctx) {
   OUT(arr);
 }
 void native_aset(KCtx *ctx) {
-  KVal val = arr_pop(ctx->stack);
-  KVal idx = arr_pop(ctx->stack);
-  KVal arr = arr_peek(ctx->stack);
-  size_t i = (size_t)idx.data.number;
-  if (i < 0 || i > arr.data.array->size) {
+  KVal val = stack_pop(ctx->stack);
+  KVal idx = stack_pop(ctx->stack);
+  KVal arr = TOP();
+  size_t i = (size_t)kval_int(idx);
+  if (arr.type == KT_VECTOR) {
+    KVal ret;
+    if (i >= arr.data.vector->size) {
+      err(ret, "Index out of bounds %zu (0 - %zu inclusive)", i,
+          arr.data.vector->size - 1);
+    } else if (!is_number(val)) {
+      err(ret, "Expected a number to store in vector");
+    } else {
+      vec_set(arr.data.vector, i, val);
+      return;
+    }
+    stack_push(ctx->stack, ret);
+  } else if (i < 0 || i > arr.data.array->size) {
     KVal ret;
     err(ret, "Index out of bounds %zu (0 - %zu inclusive)", i,
         arr.data.array->size);
-    arr_push(ctx->stack, ret);
+    stack_push(ctx->stack, ret);
   } else {
     if (i == arr.data.array->size) {
       arr_push(arr.data.array, val);
     } else {
+      arr_modified(arr.data.array);
       arr.data.array->items[i] = val;
     }
   }
 }
 
 void native_adel(KCtx *ctx) {
-  KVal idx = arr_pop(ctx->stack);
-  KVal arr = arr_peek(ctx->stack);
-  size_t i = (size_t)idx.data.number;
-  if (i < 0 || i > arr.data.array->size) {
+  IN_NUM(idx);
+  IN(arr, KT_ARRAY);
+  OUT(arr);
+  size_t i = (size_t)kval_int(idx);
+  if (i >= arr.data.array->size) {
     KVal ret;
     err(ret, "Index out of bounds %zu (0 - %zu inclusive)", i,
         arr.data.array->size - 1);
-    arr_push(ctx->stack, ret);
+    OUT(ret);
   } else {
-    for (size_t idx = i; idx < arr.data.array->size - 1; idx++) {
-      arr.data.array->items[i] = arr.data.array->items[i+1];
-    }
-    arr.data.array->size--;
+    arr_remove_nth(arr.data.array, i);
   }
 }
 
+/* (arr -- arr item)
+ * remove last item of array
+ */
+void native_apop(KCtx *ctx) {
+  IN(arr, KT_ARRAY);
+  KVal item;
+  if (arr.data.array->size)
+    item = arr_pop(arr.data.array);
+  else
+    err(item, "Can't pop from empty array");
+  OUT(arr);
+  OUT(item);
+}
+
+/* (arr item -- arr)
+ * add item to the front of array
+ */
+void native_apush_front(KCtx *ctx) {
+  IN_ANY(v);
+  IN(arr, KT_ARRAY);
+  arr_unshift(arr.data.array, v);
+  OUT(arr);
+}
+
+/* (arr -- arr item)
+ * remove first item of array
+ */
+void native_apop_front(KCtx *ctx) {
+  IN(arr, KT_ARRAY);
+  KVal item;
+  if (arr.data.array->size)
+    item = arr_shift(arr.data.array);
+  else
+    err(item, "Can't pop from empty array");
+  OUT(arr);
+  OUT(item);
+}
+
+/* (hm key val -- hm)
+ * add mapping to hashmap, replacing any previous value for key
+ */
+void native_hmput(KCtx *ctx) {
+  IN_ANY(val);
+  IN_ANY(key);
+  IN(hm, KT_HASHMAP);
+  hm_put(hm.data.hashmap, key, val);
+  OUT(hm);
+}
+
+/* (hm key -- hm val)
+ * get value for key, nil if there is no mapping
+ */
+void native_hmget(KCtx *ctx) {
+  IN_ANY(key);
+  IN(hm, KT_HASHMAP);
+  OUT(hm);
+  OUT(hm_get(hm.data.hashmap, key));
+}
+
+/* (hm key -- hm)
+ * delete mapping for key
+ */
+void native_hmdel(KCtx *ctx) {
+  IN_ANY(key);
+  IN(hm, KT_HASHMAP);
+  hm_del(hm.data.hashmap, key);
+  OUT(hm);
+}
+
 /* (arr-in from to -- arr-in arr-out)
- * copy a slice of an array or string
+ * copy a slice of an array, string slices share the buffer
  */
 void native_slice(KCtx *ctx) {
-  IN(to, KT_NUMBER);
-  IN(from, KT_NUMBER);
+  IN_NUM(to);
+  IN_NUM(from);
   IN_ANY(arr);
   size_t len;
   KVal copy, error;
   if (arr.type == KT_STRING) {
-    len = arr.data.string.len;
+    len = kval_str(&arr).len;
   } else if (arr.type == KT_ARRAY) {
     len = arr.data.array->size;
+  } else if (arr.type == KT_VECTOR) {
+    len = arr.data.vector->size;
   } else {
-    err(error, "Expected array or string to copy");
+    err(error, "Expected array, vector or string to copy");
     goto fail;
   }
-  size_t start = (size_t)from.data.number;
-  size_t end = (size_t) to.data.number;
+  size_t start = (size_t)kval_int(from);
+  size_t end = (size_t)kval_int(to);
   if (start < 0 || start > len || end < 0 || end > len) {
     err(error, "Copy range (%zu - %zu) out of bounds, valid range: 0 - %zu",
         start, end, len);
@@ -1241,18 +4446,18 @@ void native_slice(KCtx *ctx) {
   }
 
   if (arr.type == KT_STRING) {
-    // copy string
-    copy = (KVal){.type = KT_STRING,
-                  .data.string = {.len = end - start,
-                                  .data = tgc_alloc(&gc, end-start)}};
-    memcpy(copy.data.string.data, &arr.data.string.data[start], end-start);
+    copy = str_slice(&arr, start, end);
+  } else if (arr.type == KT_VECTOR) {
+    KVector *v = vec_new(arr.data.vector->type, end - start);
+    memcpy(v->items.ints, arr.data.vector->items.ints + start,
+           (end - start) * sizeof(int64_t));
+    copy = vec_val(v);
   } else {
     // copy array
-    copy =
-        (KVal){.type = KT_ARRAY, .data.array = tgc_alloc(&gc, sizeof(KArray))};
-    for(size_t i=start;i<end;i++) {
-      arr_push(copy.data.array, arr.data.array->items[i]);
-    }
+    KArray *a = arr_new(end - start);
+    memcpy(a->items, arr.data.array->items + start, (end - start) * sizeof(KVal));
+    a->size = end - start;
+    copy = (KVal){.type = KT_ARRAY, .data.array = a};
   }
 
   OUT(arr);
@@ -1261,6 +4466,165 @@ void native_slice(KCtx *ctx) {
 fail:
   OUT(error);
 }
+/* (arr -- vec) or (n -- vec)
+ * vector of the numbers in array or vector, or of n zeros
+ */
+void vec_convert(KCtx *ctx, KType type) {
+  IN_ANY(from);
+  KVal error;
+  KVector *v;
+  if (is_number(from)) {
+    int64_t n = kval_int(from);
+    if (n < 0) {
+      err(error, "Can't make vector of %" PRId64 " items", n);
+      goto fail;
+    }
+    v = vec_new(type, n);
+    memset(v->items.ints, 0, n * sizeof(int64_t));
+  } else if (from.type == KT_ARRAY) {
+    KArray *arr = from.data.array;
+    v = vec_new(type, arr->size);
+    for (size_t i = 0; i < arr->size; i++) {
+      if (!is_number(arr->items[i])) {
+        err(error, "Expected only numbers in array, item %zu is not", i);
+        goto fail;
+      }
+      vec_set(v, i, arr->items[i]);
+    }
+  } else if (from.type == KT_VECTOR) {
+    v = vec_new(type, from.data.vector->size);
+    for (size_t i = 0; i < v->size; i++)
+      vec_set(v, i, vec_get(from.data.vector, i));
+  } else {
+    err(error, "Expected array, vector or size to make vector of");
+    goto fail;
+  }
+  OUT(vec_val(v));
+  return;
+fail:
+  OUT(error);
+}
+
+void native_numbers(KCtx *ctx) { vec_convert(ctx, KT_NUMBER); }
+void native_ints(KCtx *ctx) { vec_convert(ctx, KT_INT); }
+
+/* (vec -- arr)
+ * array of the numbers in vector
+ */
+void native_vec_array(KCtx *ctx) {
+  IN_VEC(vec);
+  KVector *v = vec.data.vector;
+  KArray *arr = arr_new(v->size);
+  for (size_t i = 0; i < v->size; i++)
+    arr->items[i] = vec_get(v, i);
+  arr->size = v->size;
+  OUT(((KVal){.type = KT_ARRAY, .data.array = arr}));
+}
+
+/* Sum of x[i] * y[i], or of x[i] if y is NULL. Separate partial sums let
+ * the additions run in parallel, as they can't be reordered otherwise.
+ */
+double sum_doubles(const double *x, const double *y, size_t n) {
+  double s[4] = {0};
+  size_t i = 0;
+  if (y) {
+    for (; i + 4 <= n; i += 4)
+      for (int k = 0; k < 4; k++)
+        s[k] += x[i + k] * y[i + k];
+    for (; i < n; i++)
+      s[0] += x[i] * y[i];
+  } else {
+    for (; i + 4 <= n; i += 4)
+      for (int k = 0; k < 4; k++)
+        s[k] += x[i + k];
+    for (; i < n; i++)
+      s[0] += x[i];
+  }
+  return (s[0] + s[1]) + (s[2] + s[3]);
+}
+
+/* (vec -- n)
+ * sum of the numbers in vector
+ */
+void native_sum(KCtx *ctx) {
+  IN_VEC(vec);
+  KVector *v = vec.data.vector;
+  if (v->type == KT_INT) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < v->size; i++)
+      sum += (uint64_t)v->items.ints[i];
+    OUT(int_val((int64_t)sum));
+  } else {
+    double sum = sum_doubles(v->items.numbers, NULL, v->size);
+    OUT(((KVal){.type = KT_NUMBER, .data.number = sum}));
+  }
+}
+
+/* (a b -- n)
+ * sum of the products of the numbers in vectors a and b
+ */
+void native_dot(KCtx *ctx) {
+  IN_VEC(b);
+  IN_VEC(a);
+  KVector *x = a.data.vector, *y = b.data.vector;
+  KVal error;
+  if (x->size != y->size) {
+    err(error, "Vectors have different sizes (%zu and %zu)", x->size,
+        y->size);
+    OUT(error);
+  } else if (x->type == KT_INT && y->type == KT_INT) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < x->size; i++)
+      sum += (uint64_t)x->items.ints[i] * (uint64_t)y->items.ints[i];
+    OUT(int_val((int64_t)sum));
+  } else {
+    KArenaMark mark = arena_mark(ctx);
+    double unused;
+    double sum = sum_doubles(vec_doubles(ctx, a, &unused),
+                             vec_doubles(ctx, b, &unused), x->size);
+    arena_release(ctx, mark);
+    OUT(((KVal){.type = KT_NUMBER, .data.number = sum}));
+  }
+}
+
+#define VEC_EXTREME(T, items, n, cmp)                                          \
+  T m = items[0];                                                              \
+  for (size_t i = 1; i < n; i++)                                               \
+    m = items[i] cmp m ? items[i] : m
+
+/* (vec -- n)
+ * smallest or largest number in vector
+ */
+void vec_extreme(KCtx *ctx, bool max) {
+  IN_VEC(vec);
+  KVector *v = vec.data.vector;
+  KVal result;
+  if (!v->size) {
+    err(result, "Expected a vector with numbers");
+  } else if (v->type == KT_INT) {
+    if (max) {
+      VEC_EXTREME(int64_t, v->items.ints, v->size, >);
+      result = int_val(m);
+    } else {
+      VEC_EXTREME(int64_t, v->items.ints, v->size, <);
+      result = int_val(m);
+    }
+  } else {
+    result.type = KT_NUMBER;
+    if (max) {
+      VEC_EXTREME(double, v->items.numbers, v->size, >);
+      result.data.number = m;
+    } else {
+      VEC_EXTREME(double, v->items.numbers, v->size, <);
+      result.data.number = m;
+    }
+  }
+  OUT(result);
+}
+
+void native_min(KCtx *ctx) { vec_extreme(ctx, false); }
+void native_max(KCtx *ctx) { vec_extreme(ctx, true); }
+
 bool check_ref_name(KVal ref, KVal *errv) {
  if (ref.type != KT_REF_NAME) {
    err(*errv, "Expected variable reference.");
@@ -1278,61 +4642,62 @@ bool check_ref_value(KVal refv, KVal *errv) {
 }
 
 void native_deref(KCtx *ctx) {
-  KVal ref = arr_pop(ctx->stack);
+  KVal ref = stack_pop(ctx->stack);
   KVal val;
   if(check_ref_name(ref, &val)) {
-    KVal refv = hm_get(ctx->names, ref);
+    KVal refv = names_get(ctx, ref);
     if (refv.type == KT_NIL)
       val = refv;
     else
       val = refv.data.ref->value;
   }
-  arr_push(ctx->stack, val);
+  stack_push(ctx->stack, val);
 }
 
 void native_reset(KCtx *ctx) {
-  KVal val = arr_pop(ctx->stack);
-  KVal ref = arr_pop(ctx->stack);
+  KVal val = stack_pop(ctx->stack);
+  KVal ref = stack_pop(ctx->stack);
   KVal err;
   if (check_ref_name(ref, &err)) {
-    KVal refv = hm_get(ctx->names, ref);
+    KVal refv = names_get(ctx, ref);
     if (refv.type == KT_NIL) {
       // not found, create new reference value holder
       refv = (KVal){.type = KT_REF_VALUE,
-                    .data.ref = tgc_alloc(&gc, sizeof(KRef))};
+                    .data.ref = alloc_node(sizeof(KRef))};
       refv.data.ref->value = val;
-      hm_put(ctx->names, ref, refv);
+      names_put(ctx, ref, refv);
       return;
     } else {
       // already exists, just set it
+      gc_write(refv.data.ref);
       refv.data.ref->value = val;
       return;
     }
   }
 
-  arr_push(ctx->stack, err);
+  stack_push(ctx->stack, err);
 }
 
 void native_swap_ref_value(KCtx *ctx, bool value_in_stack) {
-  IN_ANY(code);
-  if(code.type == KT_ARRAY) code.type = KT_BLOCK;
+  IN_EXEC(code);
   IN(ref, KT_REF_NAME);
   KVal err, refv;
   if (check_ref_name(ref, &err)) {
-    refv = hm_get(ctx->names, ref);
+    refv = names_get(ctx, ref);
     if (refv.type == KT_NIL) {
       // not found, create new reference value holder
       refv = (KVal){.type = KT_REF_VALUE,
-                    .data.ref = tgc_alloc(&gc, sizeof(KRef))};
+                    .data.ref = alloc_node(sizeof(KRef))};
       refv.data.ref->value = (KVal){.type = KT_NIL};
-      hm_put(ctx->names, ref, refv);
+      names_put(ctx, ref, refv);
     }
     // put value in stack and execute code
     OUT(refv.data.ref->value);
     exec(ctx, code);
-    IN_ANY(res);
+    KVal res = stack_pop(ctx->stack);
+    gc_write(refv.data.ref);
     refv.data.ref->value = res;
-    if(value_in_stack) OUT(res);
+    if(value_in_stack) stack_push(ctx->stack, res);
     return;
   }
   OUT(err);
@@ -1349,41 +4714,269 @@ void native_swap_ref(KCtx *ctx) { native_swap_ref_value(ctx, false); }
  */
 void native_swap_ref_cur(KCtx *ctx) { native_swap_ref_value(ctx, true); }
 
-bool kokoki_eval(KCtx *ctx, const char *source);
+bool eval(KCtx *ctx, const char *source);
 void native_eval(KCtx *ctx) {
   IN(source, KT_STRING);
-  char *src = tgc_alloc(&gc, source.data.string.len + 1);
-  src[source.data.string.len] = 0;
-  memcpy(src, source.data.string.data, source.data.string.len);
-  kokoki_eval(ctx, src);
-  tgc_free(&gc, src);
+  KArenaMark mark = arena_mark(ctx);
+  eval(ctx, c_str(ctx, kval_str(&source)));
+  arena_release(ctx, mark);
 }
 
+/* "lib.ki" use
+ * evaluate file unless it is already loaded and hasn't changed since.
+ * Loaded modules are kept by real path with their modification time.
+ */
 void native_use(KCtx *ctx) {
+  IN(name, KT_STRING);
+  KArenaMark mark = arena_mark(ctx);
+  char *filename = c_str(ctx, kval_str(&name));
+  char *path = realpath(filename, NULL);
+  struct stat b;
+  if (!path || stat(path, &b) != 0) {
+    KVal error;
+    err(error, "Can't read file %s: %s", filename, strerror(errno));
+    free(path);
+    arena_release(ctx, mark);
+    OUT(error);
+    return;
+  }
+  arena_release(ctx, mark);
+  KVal key = copy_str(KT_STRING, path, path + strlen(path));
+  free(path);
+  KVal mtime = {.type = KT_INT,
+                .data.integer =
+                    b.st_mtim.tv_sec * INT64_C(1000000000) + b.st_mtim.tv_nsec};
+  // parallel words share the modules, one of the threads loads it
+  LOCK(heap->dict_lock);
+  KVal loaded = hm_get(ctx->modules, key);
+  bool current =
+      loaded.type == KT_INT && loaded.data.integer == mtime.data.integer;
+  // marked before evaluating, so modules using each other load once
+  if (!current)
+    hm_put(ctx->modules, key, mtime);
+  UNLOCK(heap->dict_lock);
+  if (current)
+    return;
+  OUT(key);
   native_slurp(ctx);
   native_eval(ctx);
 }
 
+/* [code] profile
+ * run code counting calls and time of the words it uses, counts add up
+ * over runs until profile-reset. See profile-report and profile-folded.
+ */
+void native_profile(KCtx *ctx) {
+  IN_EXEC(code);
+  if (ctx->profiling) {
+    exec(ctx, code);
+    return;
+  }
+  if (!ctx->profile)
+    ctx->profile = calloc(1, sizeof(KProfile));
+  ctx->profiling = true;
+  exec(ctx, code);
+  ctx->profiling = false;
+}
+
+int prof_cmp(const void *a, const void *b) {
+  double x = (*(KProfWord **)a)->self, y = (*(KProfWord **)b)->self;
+  return (x < y) - (x > y);
+}
+
+void prof_report(KCtx *ctx, FILE *out) {
+  KProfile *p = ctx->profile;
+  size_t n = 0;
+  for (KProfWord *w = p ? p->words : NULL; w; w = w->next)
+    n++;
+  KProfWord **words = arena_alloc(ctx, n * sizeof(KProfWord *) + 1);
+  n = 0;
+  for (KProfWord *w = p ? p->words : NULL; w; w = w->next)
+    words[n++] = w;
+  qsort(words, n, sizeof(KProfWord *), prof_cmp);
+  fprintf(out, "%12s %12s %12s  %s\n", "calls", "total ms", "self ms", "word");
+  for (size_t i = 0; i < n; i++) {
+    KProfWord *w = words[i];
+    fprintf(out, "%12" PRIu64 " %12.3f %12.3f  %.*s\n", w->calls,
+            w->total * 1e3, w->self * 1e3, (int)w->word->name.len,
+            w->word->name.data);
+  }
+}
+
+/* ( -- )
+ * print words counted by profile, most time spent in the word first.
+ */
+void native_profile_report(KCtx *ctx) {
+  KArenaMark mark = arena_mark(ctx);
+  out_flush(&ctx->out);
+  prof_report(ctx, stdout);
+  arena_release(ctx, mark);
+}
+
+void prof_fold(FILE *out, KProfNode *node, KProfNode **path) {
+  path[node->depth] = node;
+  uint64_t us = (uint64_t)(node->self * 1e6);
+  if (node->depth && us) {
+    for (size_t i = 1; i <= node->depth; i++) {
+      KString name = path[i]->word->word->name;
+      fprintf(out, "%s%.*s", i > 1 ? ";" : "", (int)name.len, name.data);
+    }
+    fprintf(out, " %" PRIu64 "\n", us);
+  }
+  for (KProfNode *n = node->children; n; n = n->next)
+    prof_fold(out, n, path);
+}
+
+bool prof_write_folded(KCtx *ctx, const char *filename) {
+  FILE *out = fopen(filename, "w");
+  if (!out)
+    return false;
+  KProfNode *path[KOKOKI_PROFILE_DEPTH + 1];
+  if (ctx->profile)
+    prof_fold(out, &ctx->profile->root, path);
+  return fclose(out) == 0;
+}
+
+/* ("file" -- )
+ * write time of each call path counted by profile as folded stacks, one
+ * line per path with the microseconds spent in its last word, as used by
+ * flamegraph tools.
+ */
+void native_profile_folded(KCtx *ctx) {
+  IN(name, KT_STRING);
+  KArenaMark mark = arena_mark(ctx);
+  char *filename = c_str(ctx, kval_str(&name));
+  if (!prof_write_folded(ctx, filename)) {
+    KVal error;
+    err(error, "Can't write file %s: %s", filename, strerror(errno));
+    OUT(error);
+  }
+  arena_release(ctx, mark);
+}
+
+/* ( -- )
+ * forget counts of profile
+ */
+void native_profile_reset(KCtx *ctx) {
+  if (ctx->profiling)
+    return; // the running calls need their frames
+  prof_free(ctx->profile);
+  ctx->profile = NULL;
+}
+
+/* ( -- )
+ * run a full collection now
+ */
+void native_gc(KCtx *ctx) { gc_collect(); }
+
+KVal cstr_val(const char *s) {
+  return str_val((KString){.len = strlen(s), .data = (char *)s});
+}
+
+/* ( -- stats)
+ * hashmap of collector statistics, see KGcStats
+ */
+void native_gc_stats(KCtx *ctx) {
+  KGcStats s;
+  kokoki_gc_stats(ctx, &s);
+  KHashMap *hm = alloc_node(sizeof(KHashMap));
+  hm_put(hm, cstr_val("heap-bytes"), int_val(s.heap_bytes));
+  hm_put(hm, cstr_val("objects"), int_val(s.objects));
+  hm_put(hm, cstr_val("allocations"), int_val(s.allocations));
+  hm_put(hm, cstr_val("allocated-bytes"), int_val(s.allocated_bytes));
+  hm_put(hm, cstr_val("collections"), int_val(s.collections));
+  hm_put(hm, cstr_val("gc-ms"),
+         (KVal){.type = KT_NUMBER, .data.number = s.gc_seconds * 1e3});
+  hm_put(hm, cstr_val("max-pause-ms"),
+         (KVal){.type = KT_NUMBER, .data.number = s.max_pause * 1e3});
+#ifdef KOKOKI_ALLOC_STATS
+  hm_put(hm, cstr_val("strings"), int_val(s.strings));
+  hm_put(hm, cstr_val("arrays"), int_val(s.arrays));
+  hm_put(hm, cstr_val("hashmaps"), int_val(s.hashmaps));
+  hm_put(hm, cstr_val("errors"), int_val(s.errors));
+#endif
+  OUT(((KVal){.type = KT_HASHMAP, .data.hashmap = hm}));
+}
+
+/* {"growth" 1.0 "min-heap" 8000000} gc-tune
+ * change collector tuning, leaves nothing unless there is an error.
+ * growth is how much can be allocated relative to the live data before
+ * collecting, min-heap is the heap size in bytes below which there are no
+ * collections and nursery is the number of blocks between minor
+ * collections in the generational build.
+ */
+void native_gc_tune(KCtx *ctx) {
+  IN(tuning, KT_HASHMAP);
+  static const char *settings[] = {"growth", "min-heap", "nursery"};
+  double v[3] = {0};
+  size_t found = 0;
+  KVal error;
+  for (size_t i = 0; i < 3; i++) {
+    KVal x = hm_get(tuning.data.hashmap, cstr_val(settings[i]));
+    if (x.type == KT_NIL)
+      continue;
+    if (!is_number(x) || kval_number(x) <= 0) {
+      err(error, "Expected a positive number for %s", settings[i]);
+      OUT(error);
+      return;
+    }
+    v[i] = kval_number(x);
+    found++;
+  }
+  if (found != tuning.data.hashmap->size) {
+    err(error, "Unknown gc-tune setting, expected growth, min-heap or nursery");
+    OUT(error);
+    return;
+  }
+  KGcTuning t = {.growth = v[0], .min_heap = (size_t)v[1],
+                 .nursery = (size_t)v[2]};
+  kokoki_gc_tune(ctx, &t);
+}
+
+/* Shallow copy of a container. Arrays share their items with the copy
+ * until one of them is changed, so copying is O(1). Strings are never
+ * changed in place and are returned as is.
+ */
 KVal copy(KVal v) {
- switch (v.type) {
- case KT_ARRAY: {
-   KArray *arr = tgc_alloc(&gc, sizeof(KArray));
-   arr->capacity = v.data.array->capacity;
-   arr->size = 0;
-   arr->items = tgc_alloc(&gc, sizeof(KVal) * arr->capacity);
-   for (size_t i = 0; i < v.data.array->size; i++) {
-     arr_push(arr, copy(v));
-   }
-   return (KVal){.type = KT_ARRAY, .data.array = arr};
- }
- case KT_STRING: {
-   KString str = {.len = v.data.string.len,
-                  .data = tgc_alloc(&gc, v.data.string.len)};
-   memcpy(str.data, v.data.string.data, str.len);
-   return (KVal){.type = KT_STRING, .data.string = str};
- }
-   // FIXME: implement hashmaps
- default:
+  switch (v.type) {
+  case KT_ARRAY: {
+    KArray *src = v.data.array;
+    KArray *arr = arr_new(0);
+    if (src->size) {
+      gc_write(src);
+      if (!src->shared)
+        src->shared = src;
+      arr->shared = src->shared;
+      arr->items = src->items;
+      arr->base = src->base;
+      arr->size = arr->capacity = src->size;
+      arr->hash = src->hash;
+      arr->resolved = src->resolved;
+    }
+    return (KVal){.type = KT_ARRAY, .data.array = arr};
+  }
+  case KT_HASHMAP: {
+    KHashMap *src = v.data.hashmap;
+    KHashMap *hm = alloc_node(sizeof(KHashMap));
+    COUNT_ALLOC(KA_HASHMAP);
+    if (!hm) {
+      fprintf(stderr, "Out of memory for hashmap\n");
+      exit(1);
+    }
+    *hm = *src;
+    if (src->capacity) {
+      hm->items = alloc_node(src->capacity * sizeof(KHashMapEntry));
+      if (!hm->items) {
+        fprintf(stderr, "Out of memory for hashmap\n");
+        exit(1);
+      }
+      memcpy(hm->items, src->items, src->capacity * sizeof(KHashMapEntry));
+    }
+    return (KVal){.type = KT_HASHMAP, .data.hashmap = hm};
+  }
+  case KT_VECTOR:
+    return vec_val(vec_copy(v.data.vector));
+  default:
     return v;
   }
 }
@@ -1396,16 +4989,17 @@ void native_copy(KCtx *ctx) {
 }
 
 void native_dump(KCtx *ctx) {
-  printf("STACK(%zu): ", ctx->stack->size);
+  out_printf(&ctx->out, "STACK(%zu): ", ctx->stack->size);
   debug_stack(ctx);
-  printf("\n");
+  out_str(&ctx->out, "\n");
 }
 
 void native_read(KCtx *ctx) {
   char buf[512];
   char *at = buf;
+  native_flush(ctx); // show a prompt printed before reading
   fgets(buf, 512, stdin);
-  OUT(read(&at));
+  OUT(read(ctx, &at));
 }
 
 /*
@@ -1414,74 +5008,491 @@ void native_read(KCtx *ctx) {
  * [ "hello" . ] [ @foo get 10 > ]  while
  */
 
-void kokoki_init(void (*callback)(KCtx*,void*), void *user) {
-  int dummy;
-  tgc_start(&gc, &dummy);
-  KCtx *ctx = kctx_new();
-#define DO(name, op, type) native(ctx, STRINGIFY(op), native_##name);
+/* KOKOKI_PROFILE=1 profiles whole instances and prints the report to
+ * stderr when they are freed, any other value names a file to write
+ * the folded stacks to.
+ */
+void profile_from_env(KCtx *ctx) {
+  if (getenv("KOKOKI_PROFILE")) {
+    ctx->profile = calloc(1, sizeof(KProfile));
+    ctx->profiling = true;
+  }
+}
+
+void profile_to_env(KCtx *ctx) {
+  const char *to = getenv("KOKOKI_PROFILE");
+  if (!to || !ctx->profile)
+    return;
+  if (!strcmp(to, "1"))
+    prof_report(ctx, stderr);
+  else if (!prof_write_folded(ctx, to))
+    fprintf(stderr, "Can't write profile %s: %s\n", to, strerror(errno));
+}
+
+KHeap *heap_new(void *stack_bottom) {
+  KHeap *h = calloc(1, sizeof(KHeap));
+  if (!h)
+    return NULL;
+  tgc_start(&h->gc, stack_bottom);
+#ifdef KOKOKI_GC_GENERATIONAL
+  tgc_generational(&h->gc, KOKOKI_GC_NURSERY);
+#endif
+#ifdef KOKOKI_THREADS
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&h->dict_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  pthread_mutex_init(&h->lock, NULL);
+#endif
+  return h;
+}
+
+KCtx *kokoki_new(const KOptions *opts) {
+  KHeap *h = heap_new(__builtin_frame_address(0));
+  if (!h)
+    return NULL;
+  KHeap *caller_heap = heap;
+  heap = h;
+  h->depth = 1;
+  KCtx *ctx = kctx_new(opts ? opts->stack_size : 0);
+  ctx->threads = opts ? opts->threads : 0;
+  tgc_pause(&h->gc); // setup leaves next to no garbage
+#define DO(name, op, type) native(ctx, STRINGIFY(op), native_##name, 2, 1);
   DO_NUM_OPS
 #undef DO
-  native(ctx, "=", native_equals);
-  native(ctx, "%", native_mod);
-  native(ctx, "pick", native_pick);
-  native(ctx, "move", native_move);
-  native(ctx, "dup", native_dup);
-  native(ctx, "rot", native_rot);
-  native(ctx, "swap", native_swap);
-  native(ctx, "drop", native_drop);
-  native(ctx, "exec", native_exec);
-  native(ctx, "cond", native_cond);
-  native(ctx, ".", native_print);
-  native(ctx, "nl", native_nl);
-  native(ctx, "slurp", native_slurp);
-  native(ctx, "each", native_each);
-  native(ctx, "fold", native_fold);
-  native(ctx, "foldi", native_foldi);
-  native(ctx, "cat", native_cat);
-  native(ctx, "filter", native_filter);
-  native(ctx, "not", native_not);
-  native(ctx, "and", native_and);
-  native(ctx, "apush", native_apush);
-  native(ctx, "len", native_len);
-  native(ctx, "aget", native_aget);
-  native(ctx, "aset", native_aset);
-  native(ctx, "adel", native_adel);
-  native(ctx, "slice", native_slice);
-  native(ctx, "times", native_times);
-  native(ctx, "?", native_deref);
-  native(ctx, "!", native_reset);
-  native(ctx, "!!", native_swap_ref);
-  native(ctx, "!?", native_swap_ref_cur);
-  native(ctx, "eval", native_eval);
-  native(ctx, "use", native_use);
-  native(ctx, "reverse", native_reverse);
-  native(ctx, "copy", native_copy);
-  native(ctx, "dump", native_dump);
-  native(ctx, "while", native_while);
-  native(ctx, "read", native_read);
-  native(ctx, "sort", native_sort);
+  native(ctx, "=", native_equals, 2, 1);
+  native(ctx, "%", native_mod, 2, 1);
+  native(ctx, "pick", native_pick, 1, 1);
+  native(ctx, "move", native_move, 1, 1);
+  native(ctx, "dup", native_dup, 1, 2);
+  native(ctx, "rot", native_rot, 3, 3);
+  native(ctx, "swap", native_swap, 2, 2);
+  native(ctx, "drop", native_drop, 1, 0);
+  native(ctx, "exec", native_exec, 1, 0);
+  native(ctx, "cond", native_cond, 1, 1);
+  native(ctx, "if", native_if, 2, 1);
+  native(ctx, "if-else", native_if_else, 3, 1);
+  native(ctx, ".", native_print, 1, 0);
+  native(ctx, "nl", native_nl, 0, 0);
+  native(ctx, "flush", native_flush, 0, 0);
+  native(ctx, "slurp", native_slurp, 1, 1);
+  native(ctx, "open", native_open, 1, 1);
+  native(ctx, "close", native_close, 1, 0);
+  native(ctx, "read-line", native_read_line, 1, 2);
+  native(ctx, "each-line", native_each_line, 2, 0);
+  native(ctx, "each", native_each, 2, 1);
+  native(ctx, "fold", native_fold, 2, 1);
+  native(ctx, "foldi", native_foldi, 2, 1);
+  native(ctx, "cat", native_cat, 2, 1);
+  native(ctx, "filter", native_filter, 2, 1);
+  native(ctx, "peach", native_peach, 2, 1);
+  native(ctx, "pfilter", native_pfilter, 2, 1);
+  native(ctx, "preduce", native_preduce, 2, 1);
+  native(ctx, "not", native_not, 1, 1);
+  native(ctx, "and", native_and, 2, 1);
+  native(ctx, "apush", native_apush, 2, 1);
+  native(ctx, "len", native_len, 1, 2);
+  native(ctx, "aget", native_aget, 2, 2);
+  native(ctx, "aset", native_aset, 3, 2);
+  native(ctx, "adel", native_adel, 2, 2);
+  native(ctx, "apop", native_apop, 1, 2);
+  native(ctx, "apush-front", native_apush_front, 2, 1);
+  native(ctx, "apop-front", native_apop_front, 1, 2);
+  native(ctx, "slice", native_slice, 3, 2);
+  native(ctx, "range", native_range, 2, 1);
+  native(ctx, "seq", native_seq, 1, 1);
+  native(ctx, "map", native_map, 2, 1);
+  native(ctx, "take", native_take, 2, 1);
+  native(ctx, "into-array", native_into_array, 1, 1);
+  native(ctx, "numbers", native_numbers, 1, 1);
+  native(ctx, "ints", native_ints, 1, 1);
+  native(ctx, "vec->array", native_vec_array, 1, 1);
+  native(ctx, "sum", native_sum, 1, 1);
+  native(ctx, "dot", native_dot, 2, 1);
+  native(ctx, "min", native_min, 1, 1);
+  native(ctx, "max", native_max, 1, 1);
+  native(ctx, "ch-idx", native_ch_idx, 2, 2);
+  native(ctx, "split-at", native_split_at, 2, 2);
+  native(ctx, "lines", native_lines, 1, 1);
+  native(ctx, "split", native_split, 2, 1);
+  native(ctx, "join", native_join, 2, 1);
+  native(ctx, "hmput", native_hmput, 3, 1);
+  native(ctx, "hmget", native_hmget, 2, 2);
+  native(ctx, "hmdel", native_hmdel, 2, 1);
+  native(ctx, "times", native_times, 2, 0);
+  native(ctx, "?", native_deref, 1, 1);
+  native(ctx, "!", native_reset, 2, 1);
+  native(ctx, "!!", native_swap_ref, 2, 1);
+  native(ctx, "!?", native_swap_ref_cur, 2, 1);
+  native(ctx, "eval", native_eval, 1, 0);
+  native(ctx, "use", native_use, 1, 0);
+  native(ctx, "profile", native_profile, 1, 0);
+  native(ctx, "gc", native_gc, 0, 0);
+  native(ctx, "gc-stats", native_gc_stats, 0, 1);
+  native(ctx, "gc-tune", native_gc_tune, 1, 1);
+  native(ctx, "profile-report", native_profile_report, 0, 0);
+  native(ctx, "profile-folded", native_profile_folded, 1, 1);
+  native(ctx, "profile-reset", native_profile_reset, 0, 0);
+  native(ctx, "reverse", native_reverse, 1, 1);
+  native(ctx, "copy", native_copy, 1, 1);
+  native(ctx, "dump", native_dump, 0, 0);
+  native(ctx, "while", native_while, 1, 0);
+  native(ctx, "read", native_read, 0, 1);
+  native(ctx, "sort", native_sort, 1, 1);
+  native(ctx, "sort-by", native_sort_by, 2, 1);
   size_t sz;
   uint8_t *stdlib;
   get_resource("stdlib.ki", &sz, &stdlib);
-  kokoki_eval(ctx, (const char*)stdlib);
-  tgc_free(&gc, stdlib);
-  callback(ctx,user);
-  tgc_stop(&gc);
+  eval(ctx, (const char*)stdlib);
+  alloc_free(stdlib);
+  tgc_resume(&h->gc);
+  profile_from_env(ctx);
+  h->depth = 0;
+  heap = caller_heap;
+  return ctx;
 }
 
-bool kokoki_eval(KCtx *ctx, const char *source) {
+/* Cloning copies everything reachable from the dictionary to the new
+ * heap. Copies of containers, refs, natives and words are remembered by
+ * the identity of the original, so shared and cyclic values stay that
+ * way and resolved words point to the new entries.
+ */
+typedef struct KClone {
+  KCtx *ctx;      // the new instance
+  KHashMap *seen; // copies by identity of the original
+} KClone;
+
+KVal identity(void *ptr) {
+  return (KVal){.type = KT_REF_VALUE, .data.ref = (KRef *)ptr};
+}
+
+void *clone_seen(KClone *c, void *ptr) {
+  KVal v = hm_get(c->seen, identity(ptr));
+  return v.type == KT_NIL ? NULL : v.data.ref;
+}
+
+void *clone_remember(KClone *c, void *ptr, void *copy) {
+  hm_put(c->seen, identity(ptr), identity(copy));
+  return copy;
+}
+
+KVal clone_val(KClone *c, KVal v);
+
+KArray *clone_arr(KClone *c, KArray *arr) {
+  KArray *a = clone_seen(c, arr);
+  if (a)
+    return a;
+  a = clone_remember(c, arr, arr_new(arr->size));
+  for (size_t i = 0; i < arr->size; i++) {
+    KVal item = clone_val(c, arr->items[i]);
+    arr_write(a);
+    a->items[a->size++] = item;
+  }
+  return a; // hash and code refer to the originals, so they are redone
+}
+
+KHashMap *clone_hm(KClone *c, KHashMap *hm) {
+  KHashMap *h = clone_seen(c, hm);
+  if (h)
+    return h;
+  h = clone_remember(c, hm, alloc_node(sizeof(KHashMap)));
+  for (size_t i = 0; i < hm->capacity; i++) {
+    KHashMapEntry *e = &hm->items[i];
+    if (e->dist)
+      hm_put(h, clone_val(c, e->key), clone_val(c, e->value));
+  }
+  return h;
+}
+
+KVal clone_val(KClone *c, KVal v) {
+  switch (v.type) {
+  case KT_STRING:
+  case KT_ERROR:
+    if (!v.small) {
+      KString s = kval_str(&v);
+      return copy_str(v.type, (char *)s.data, (char *)s.data + s.len);
+    }
+    return v;
+  case KT_NAME:
+  case KT_REF_NAME: {
+    KString name = v.data.symbol->name;
+    v.data.symbol = intern(c->ctx, name.data, name.len);
+    return v;
+  }
+  case KT_ARRAY:
+  case KT_BLOCK:
+  case KT_DEFINITION:
+    v.data.array = clone_arr(c, v.data.array);
+    return v;
+  case KT_HASHMAP:
+    v.data.hashmap = clone_hm(c, v.data.hashmap);
+    return v;
+  case KT_VECTOR: {
+    KVector *vec = clone_seen(c, v.data.vector);
+    v.data.vector = vec ? vec : clone_remember(c, v.data.vector,
+                                               vec_copy(v.data.vector));
+    return v;
+  }
+  case KT_NATIVE: {
+    KNative *n = clone_seen(c, (void *)v.data.native);
+    if (!n) {
+      n = clone_remember(c, (void *)v.data.native, alloc_node(sizeof(KNative)));
+      *n = *v.data.native;
+    }
+    v.data.native = n;
+    return v;
+  }
+  case KT_REF_VALUE: {
+    KRef *r = clone_seen(c, v.data.ref);
+    if (!r) {
+      r = clone_remember(c, v.data.ref, alloc_node(sizeof(KRef)));
+      KVal value = clone_val(c, v.data.ref->value);
+      gc_write(r);
+      r->value = value;
+    }
+    v.data.ref = r;
+    return v;
+  }
+  case KT_WORD: {
+    KWord *w = clone_seen(c, v.data.word);
+    if (!w) {
+      KString name = v.data.word->name;
+      KVal n = {.type = KT_NAME,
+                .data.symbol = intern(c->ctx, name.data, name.len)};
+      w = clone_remember(c, v.data.word, word_entry(c->ctx, n));
+      KVal value = clone_val(c, v.data.word->value);
+      gc_write(w);
+      w->value = value;
+    }
+    v.data.word = w;
+    return v;
+  }
+  case KT_SEQ: {
+    KSeq *s = clone_seen(c, v.data.seq);
+    if (!s) {
+      s = clone_remember(c, v.data.seq, alloc_node(sizeof(KSeq)));
+      *s = *v.data.seq;
+      s->src = clone_val(c, s->src);
+      s->code = clone_val(c, s->code);
+    }
+    v.data.seq = s;
+    return v;
+  }
+  case KT_FILE: // open files belong to one instance
+    return (KVal){.type = KT_NIL};
+  default:
+    return v;
+  }
+}
+
+KCtx *kokoki_clone(KCtx *src) {
+  KHeap *h = heap_new(__builtin_frame_address(0));
+  if (!h)
+    return NULL;
+  KHeap *caller_heap = heap;
+  heap = h;
+  h->depth = 1;
+  KCtx *ctx = kctx_new(src->stack->capacity);
+  ctx->threads = src->threads;
+  tgc_pause(&h->gc); // all of it is live until the copy is done
+  KClone c = {.ctx = ctx, .seen = alloc_node(sizeof(KHashMap))};
+  KHashMap *names = src->names;
+  for (size_t i = 0; i < names->capacity; i++) {
+    KHashMapEntry *e = &names->items[i];
+    if (e->dist)
+      names_put(ctx, clone_val(&c, e->key), clone_val(&c, e->value));
+  }
+  ctx->modules = clone_hm(&c, src->modules);
+  profile_from_env(ctx);
+  tgc_resume(&h->gc);
+  h->depth = 0;
+  heap = caller_heap;
+  return ctx;
+}
+
+void kokoki_free(KCtx *ctx) {
+  KHeap *h = ctx->heap;
+  out_flush(&ctx->out);
+  free(ctx->out.buf);
+  profile_to_env(ctx);
+  prof_free(ctx->profile);
+  kokoki_arena_reset(ctx);
+#ifdef KOKOKI_THREADS
+  if (h->pool)
+    pool_free(h->pool);
+#endif
+  tgc_set_flags(&h->gc, ctx, 0);
+  tgc_stop(&h->gc);
+#ifdef KOKOKI_THREADS
+  pthread_mutex_destroy(&h->lock);
+  pthread_mutex_destroy(&h->dict_lock);
+#endif
+  free(h);
+}
+
+void kokoki_init_opts(const KOptions *opts, void (*callback)(KCtx *, void *),
+                      void *user) {
+  KCtx *ctx = kokoki_new(opts);
+  if (!ctx) {
+    fprintf(stderr, "Out of memory");
+    exit(1);
+  }
+  ENTER(ctx); // collect with the stack of callback as before
+  callback(ctx, user);
+  LEAVE();
+  kokoki_free(ctx);
+}
+
+void kokoki_init(void (*callback)(KCtx*,void*), void *user) {
+  kokoki_init_opts(NULL, callback, user);
+}
+
+bool eval(KCtx *ctx, const char *source) {
   char *src = (char*) source;
   char **at = &src;
-  KVal kv = read(at);
+  KArenaMark mark = arena_mark(ctx);
+  KVal kv = read(ctx, at);
+  bool ok = true;
 
   while (kv.type != KT_EOF) {
     if (kv.type == KT_ERROR) {
-      kval_dump(kv);
-      return false;
+      kval_write(&ctx->out, kv);
+      ok = false;
+      break;
     } else {
       exec(ctx, kv);
     }
-    kv = read(at);
+    kv = read(ctx, at);
   }
-  return true;
+  arena_release(ctx, mark);
+  return ok;
+}
+
+bool kokoki_eval(KCtx *ctx, const char *source) {
+  ENTER(ctx);
+  bool ok = eval(ctx, source);
+  out_flush(&ctx->out);
+  LEAVE();
+  return ok;
+}
+
+/* The reader only scans fed text as far as needed to find where top level
+ * forms end, parsing is left to read when they are evaluated.
+ */
+enum { KR_CODE, KR_STRING, KR_LINE_COMMENT, KR_COMMENT, KR_CHAR };
+
+#define KOKOKI_READ_CHUNK 4096 // bytes read at a time by kokoki_eval_stream
+
+/* Scan the new text, return where the last complete form ends or 0 */
+size_t reader_scan(KReader *r) {
+  size_t end = 0;
+  for (size_t i = r->scanned; i < r->len; i++) {
+    char c = r->buf[i];
+    switch (r->state) {
+    case KR_STRING:
+      if (c == '"')
+        r->state = KR_CODE;
+      continue;
+    case KR_COMMENT:
+      if (c == ')')
+        r->state = KR_CODE;
+      continue;
+    case KR_CHAR:
+      if (--r->skip == 0)
+        r->state = KR_CODE;
+      continue;
+    case KR_LINE_COMMENT:
+      if (c != '\n')
+        continue;
+      r->state = KR_CODE; // the newline ends a form
+      break;
+    }
+    switch (c) {
+    case '"':
+      r->state = KR_STRING;
+      break;
+    case '#':
+      r->state = KR_LINE_COMMENT;
+      break;
+    case '(':
+      r->state = KR_COMMENT;
+      break;
+    case '\'':
+      r->state = KR_CHAR;
+      r->skip = 2;
+      break;
+    case '[': case '{': case ':':
+      r->depth++;
+      break;
+    case ']': case '}': case ';':
+      if (r->depth)
+        r->depth--;
+      break;
+    case ' ': case '\t': case '\n': case '\r':
+      if (r->depth == 0)
+        end = i + 1;
+      break;
+    }
+  }
+  r->scanned = r->len;
+  return end;
+}
+
+bool kokoki_feed(KCtx *ctx, KReader *r, const char *data, size_t len) {
+  if (r->len + len + 1 > r->capacity) {
+    size_t capacity = r->capacity ? r->capacity : KOKOKI_READ_CHUNK;
+    while (capacity < r->len + len + 1)
+      capacity *= 2;
+    r->buf = realloc(r->buf, capacity);
+    if (!r->buf) {
+      fprintf(stderr, "Out of memory");
+      exit(1);
+    }
+    r->capacity = capacity;
+  }
+  memcpy(r->buf + r->len, data, len);
+  r->len += len;
+  size_t end = reader_scan(r);
+  if (!end)
+    return true;
+  r->buf[end - 1] = 0; // whitespace after the forms
+  ENTER(ctx);
+  bool ok = eval(ctx, r->buf);
+  out_flush(&ctx->out);
+  LEAVE();
+  memmove(r->buf, r->buf + end, r->len - end);
+  r->len -= end;
+  r->scanned -= end;
+  return ok;
+}
+
+bool kokoki_feed_end(KCtx *ctx, KReader *r) {
+  bool ok = true;
+  if (r->len) {
+    r->buf[r->len] = 0;
+    ENTER(ctx);
+    ok = eval(ctx, r->buf);
+    out_flush(&ctx->out);
+    LEAVE();
+  }
+  free(r->buf);
+  *r = (KReader){0};
+  return ok;
+}
+
+bool kokoki_reader_pending(const KReader *r) { return r->len > 0; }
+
+bool kokoki_eval_stream(KCtx *ctx, FILE *fp) {
+  KReader r = {0};
+  char chunk[KOKOKI_READ_CHUNK];
+  bool ok = true;
+  // fgets returns at each newline, so piped lines are run as they come
+  while (ok && fgets(chunk, sizeof(chunk), fp))
+    ok = kokoki_feed(ctx, &r, chunk, strlen(chunk));
+  if (!ok) {
+    free(r.buf);
+    return false;
+  }
+  return kokoki_feed_end(ctx, &r);
 }
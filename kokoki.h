@@ -3,12 +3,15 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 typedef enum KType {
   KT_NIL,        // null value
   KT_TRUE,       // true boolean
   KT_FALSE,      // false boolean
   KT_NUMBER,     // numbers double precision
+  KT_INT,        // integer numbers (64-bit, wraps around on overflow)
   KT_STRING,     // string
   KT_NAME,       // variable name
   KT_ARRAY,      // dynamic array of items
@@ -19,61 +22,219 @@ typedef enum KType {
   KT_ERROR,      // error object (parsing or runtime)
   KT_DEFINITION, // ':' definition (uses array where 1st item is the name)
   KT_BLOCK,      // type of array that is executed in place
+  KT_WORD,       // name resolved to its dictionary entry
+  KT_FILE,       // file opened for reading
   KT_EOF,        // end of input
+  KT_VECTOR,     // numbers of one type stored unboxed
+  KT_SEQ,        // lazy sequence of items
 } KType;
 
 typedef struct KVal KVal;
+typedef struct KCode KCode;
+typedef struct KFrame KFrame;
+typedef struct KArray KArray;
+typedef struct KVector KVector;
+typedef struct KSeq KSeq;
 
-typedef struct KArray {
-  size_t size, capacity;
-  KVal *items;
-} KArray;
-
+/* Strings are not modified in place, so slices can share the buffer of
+ * the string they are taken from, see KSlice.
+ */
 typedef struct KString {
   size_t len;
   char *data;
 } KString;
 
+/* String sharing the buffer of a longer one, stored in place of KString
+ * when KVal.slice is set. It points to the start of the buffer, as the
+ * collector only knows pointers to the start of blocks, and finds its
+ * text at offset from it. Use kval_str to get the text.
+ */
+typedef struct KSlice {
+  uint32_t len, offset;
+  char *base;
+} KSlice;
+
+/* Buffers a slice can share */
+typedef enum KSliceKind {
+  KS_NONE,   // not a slice
+  KS_BUFFER, // base is the collected buffer of the text
+  KS_MAPPED  // base is a collected header of a mapped file
+} KSliceKind;
+
+/* Interned name, all names with the same text share one symbol */
+typedef struct KSymbol {
+  uint32_t hash;
+  KString name;
+} KSymbol;
+
 typedef struct KCtx KCtx;
 typedef struct KRef KRef;
+typedef struct KWord KWord;
+typedef struct KHashMap KHashMap;
+typedef struct KFile KFile;
+typedef struct KArena KArena;
+typedef struct KHeap KHeap;
+typedef struct KProfile KProfile;
+
+typedef struct KNative {
+  void (*fn)(KCtx *);
+  size_t in;  // items the native takes, checked before calling it
+  size_t out; // max items it leaves, room is reserved before calling it
+} KNative;
+
+/* Strings this short are stored in the value itself */
+#define KOKOKI_SMALL_STRING sizeof(KString)
 
 typedef struct KVal {
   KType type;
+  uint8_t small; // length + 1 of a string stored inline in chars, else 0
+  uint8_t slice; // KSliceKind of a string stored as a slice
   union {
     double number;
+    int64_t integer;
     KString string;
+    KSlice slice;
+    KSymbol *symbol; // KT_NAME and KT_REF_NAME
     KArray *array;
-    void (*native)(KCtx*);
+    KVector *vector;
+    KSeq *seq;
+    KHashMap *hashmap;
+    const KNative *native;
     KRef *ref;
+    KWord *word;
+    KFile *file;
+    char chars[KOKOKI_SMALL_STRING];
   } data;
 } KVal;
 
+/* Arrays made with a known size keep their items in the same block as
+ * the header. The header never moves as values share it, growing past
+ * the inline room moves the items to a separate buffer. Removing from the
+ * front moves items forward in the buffer, so arrays work as queues.
+ * A copy shares the items until either array is changed, the owner keeps
+ * inline items alive for the copies.
+ */
+struct KArray {
+  size_t size, capacity; // capacity counts from items to the buffer end
+  KVal *items;
+  KVal *base; // start of the items buffer
+  KArray *shared; // owner of the items when shared with copies, else NULL
+  KCode *code; // compiled code when executed as a block
+  uint32_t hash; // cached content hash, 0 if not known
+  bool resolved; // names in it and its arrays are resolved to words
+  KVal inline_items[];
+};
+
+/* Vectors keep their numbers unboxed in the same block as the header.
+ * The block has no pointers to other blocks, so the collector doesn't scan
+ * it. Number words work on whole vectors in plain loops over the items.
+ */
+struct KVector {
+  size_t size;
+  KType type; // KT_INT or KT_NUMBER, the type of all items
+  union {
+    int64_t *ints;
+    double *numbers;
+  } items; // right after the header
+};
+
 typedef struct KRef {
   KVal value;
 } KRef;
 
+/* Dictionary entry for a name. Resolved words point here, so redefining
+ * a name only replaces the value. */
+typedef struct KWord {
+  KVal value; // current definition, nil if not (yet) defined
+  KString name;
+  bool inlined; // built into compiled code, which is redone if redefined
+} KWord;
+
+/* Robin Hood hashmap, capacity is a power of two */
 typedef struct KHashMapEntry {
   KVal key;
   KVal value;
-  bool used;
+  uint32_t hash;
+  uint32_t dist; // distance from home slot + 1, 0 if the slot is free
 } KHashMapEntry;
 
 typedef struct KHashMap {
   size_t capacity;
   size_t size;
   KHashMapEntry *items;
+  uint32_t hash; // cached content hash, 0 if not known
 } KHashMap;
 
+/* The data stack, grows when needed but never shrinks */
+typedef struct KStack {
+  size_t size, capacity;
+  KVal *items;
+} KStack;
+
+/* Output of an instance is buffered, it is written to stdout when the
+ * buffer fills, when evaluation returns and by flush.
+ */
+typedef struct KOut {
+  char *buf;
+  size_t len, capacity;
+  bool lines; // also written at every newline, when stdout is a terminal
+} KOut;
+
 typedef struct KCtx {
-  KArray *stack;
+  KHeap *heap; // collected heap of the instance
+  KStack *stack;
   KHashMap *names;
+  KHashMap *symbols; // interned names by their text
+  KHashMap *modules; // files loaded with use, real path to mtime
+  KFrame *rstack; // return stack for running compiled code
+  size_t rsize, rcapacity;
+  KVal tail; // left by a native for its caller to execute, see exec_tail
+  KArena *arena; // scratch memory for temporaries
+  size_t threads; // threads used by parallel words, 0 for one per core
+  bool profiling;   // counting calls and time of words in profile
+  KProfile *profile;
+  KOut out; // output of the print words
 } KCtx;
 
+#define KOKOKI_STACK_SIZE 1024
+
+typedef struct KOptions {
+  size_t stack_size; // preallocated data stack size, 0 for default
+  size_t threads;    // threads for parallel words, 0 for one per core
+} KOptions;
+
+/**
+ * Create an interpreter instance with its own heap and dictionary, opts
+ * may be NULL. Instances share no state, so different instances can be
+ * used from different threads at the same time. One instance must only be
+ * used by one thread at a time. Returns NULL if out of memory.
+ */
+KCtx *kokoki_new(const KOptions *opts);
+
+/**
+ * Create an instance with a copy of the dictionary of ctx, including the
+ * words defined in it, so scripts loaded once can be reused without
+ * evaluating them again. The data stack is empty and open files are not
+ * copied. Free with kokoki_free.
+ */
+KCtx *kokoki_clone(KCtx *ctx);
+
+/**
+ * Free instance and everything allocated in it.
+ */
+void kokoki_free(KCtx *ctx);
+
 /**
  * Initialize system, calls given callback with the system.
  */
 void kokoki_init(void (*callback)(KCtx*,void*), void* user);
 
+/**
+ * Initialize system with options.
+ */
+void kokoki_init_opts(const KOptions *opts, void (*callback)(KCtx *, void *),
+                      void *user);
+
 /**
  * Evaluate the given source code.
  * Returns true on success, false otherwise.
@@ -81,13 +242,123 @@ void kokoki_init(void (*callback)(KCtx*,void*), void* user);
 bool kokoki_eval(KCtx *ctx, const char *source);
 
 /**
- * Register a native C implemented word.
+ * Reader for source that comes in chunks. Zero initialize it and feed it
+ * text, each complete top level form is evaluated as soon as whitespace
+ * follows it, only the form still being read is buffered. A chunk may end
+ * anywhere, also inside a string, a comment or a definition.
+ */
+typedef struct KReader {
+  char *buf;
+  size_t len, capacity;
+  size_t scanned; // bytes of buf already scanned
+  size_t depth;   // arrays, hashmaps and definitions open
+  int state;      // string, comment or character being read
+  int skip;       // characters left of a character literal
+} KReader;
+
+/**
+ * Feed len bytes of source to the reader and evaluate the forms they
+ * complete. Returns false if one of them failed to parse.
  */
-void kokoki_native(KCtx * ctx, const char *name, void (*native)(KCtx *));
+bool kokoki_feed(KCtx *ctx, KReader *r, const char *data, size_t len);
 
+/**
+ * Evaluate what is left in the reader at the end of input and free it.
+ */
+bool kokoki_feed_end(KCtx *ctx, KReader *r);
+
+/**
+ * True if the reader has an unfinished form waiting for more input.
+ */
+bool kokoki_reader_pending(const KReader *r);
+
+/**
+ * Evaluate source read from fp until it ends, forms are evaluated as
+ * their lines arrive so output of a piped program starts right away.
+ * Stops at the first parse error.
+ */
+bool kokoki_eval_stream(KCtx *ctx, FILE *fp);
+
+/**
+ * Register a native C implemented word. The native takes in items from the
+ * stack and leaves at most out items. The stack depth is checked before
+ * calling it, so it can use the items directly.
+ */
+void kokoki_native(KCtx *ctx, const char *name, void (*native)(KCtx *),
+                   size_t in, size_t out);
+
+/**
+ * Free the scratch memory used for temporaries. Temporaries are released
+ * when kokoki_eval returns, this also gives the memory back to the system.
+ */
+void kokoki_arena_reset(KCtx *ctx);
+
+typedef struct KGcStats {
+  size_t heap_bytes;      // bytes in blocks not collected yet
+  size_t objects;         // blocks not collected yet
+  size_t allocations;     // blocks allocated since the instance was created
+  size_t allocated_bytes; // bytes allocated since the instance was created
+  size_t collections;     // collections run
+  double gc_seconds;      // total time spent collecting
+  double max_pause;       // longest collection in seconds
+  // values allocated of each kind, only counted with KOKOKI_ALLOC_STATS
+  size_t strings, arrays, hashmaps, errors;
+} KGcStats;
+
+/**
+ * Get collector statistics of the instance.
+ */
+void kokoki_gc_stats(KCtx *ctx, KGcStats *stats);
+
+typedef struct KGcTuning {
+  double growth;   // collect after allocating this fraction of live bytes
+  size_t min_heap; // don't collect before the heap has this many bytes
+  size_t nursery;  // blocks between minor collections (generational build)
+} KGcTuning;
+
+/**
+ * Get the current collector tuning of the instance.
+ */
+void kokoki_gc_tuning(KCtx *ctx, KGcTuning *tuning);
+
+/**
+ * Change collector tuning of the instance, fields that are 0 are kept.
+ */
+void kokoki_gc_tune(KCtx *ctx, const KGcTuning *tuning);
+
+/**
+ * Run a full collection now.
+ */
+void kokoki_gc_collect(KCtx *ctx);
+
+/**
+ * Push and pop values on the data stack. Popping an empty stack returns
+ * a stack underflow error. Values are only kept alive while reachable from
+ * the instance, so a popped value must be used before the next call.
+ */
+void kokoki_push(KCtx *ctx, KVal v);
+KVal kokoki_pop(KCtx *ctx);
+
+/**
+ * Print v to stdout. What an instance prints is buffered until kokoki_eval
+ * returns, so call this between evaluations to keep the order.
+ */
 void kval_dump(KVal v);
 
+/**
+ * Get value of an integer or double number as double, 0 for other values.
+ */
+double kval_number(KVal v);
+
+/**
+ * Get the contents of a string or error value. Small strings are stored
+ * inline, so the result points into v and is valid as long as v is.
+ */
+KString kval_str(const KVal *v);
+
 void arr_push(KArray *arr, KVal val);
 KVal arr_pop(KArray *arr);
+void arr_unshift(KArray *arr, KVal val);
+KVal arr_shift(KArray *arr);
 
 #endif
@@ -1,30 +1,47 @@
 #include <stdio.h>
+#include <string.h>
 #include "kokoki.h"
 
 
 #define MAX_LINE 65536
 static char line[MAX_LINE];
 
-char *prompt(KCtx *ctx) {
-  printf("\nkokoki(%zu)> ", ctx->stack->size);
+char *prompt(KCtx *ctx, KReader *r) {
+  if (kokoki_reader_pending(r))
+    printf("... "); // definition or array spanning lines
+  else
+    printf("\nkokoki(%zu)> ", ctx->stack->size);
   fflush(stdout);
   return fgets(line, MAX_LINE, stdin);
 }
 
 void repl(KCtx *ctx, void *user) {
   printf("Welcome to Korvatunturin Konkatenatiivinen Kieli (kokoki) REPL!\n");
+  KReader r = {0};
   char *in;
-  while((in = prompt(ctx))) {
-    if(kokoki_eval(ctx, (const char *)in)) {
-      printf("  ok");
+  bool ok = true;
+  while((in = prompt(ctx, &r))) {
+    ok = kokoki_feed(ctx, &r, in, strlen(in)) && ok;
+    if (!kokoki_reader_pending(&r)) {
+      if (ok)
+        printf("  ok");
+      ok = true;
     }
   }
+  kokoki_feed_end(ctx, &r);
   printf("Bye!\n");
 }
 
+/* Files are evaluated as they are read, "-" reads from stdin */
 void run_file(KCtx *ctx, void* file) {
-  snprintf(line, MAX_LINE, "\"%s\" slurp eval", (char*) file);
-  kokoki_eval(ctx, line);
+  FILE *fp = strcmp(file, "-") ? fopen(file, "r") : stdin;
+  if (!fp) {
+    perror(file);
+    return;
+  }
+  kokoki_eval_stream(ctx, fp);
+  if (fp != stdin)
+    fclose(fp);
 }
 
 int main(int argc, char **argv) {
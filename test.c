@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include "kokoki.h"
 
 #define STRINGIFY2(X) #X
@@ -58,21 +59,21 @@ bool is_error(KVal v, const char *err) {
     printf("\n");
     return false;
   }
-  if (strlen(err) != v.data.string.len ||
-      memcmp(err,v.data.string.data, v.data.string.len) != 0) {
+  KString s = kval_str(&v);
+  if (strlen(err) != s.len || memcmp(err, s.data, s.len) != 0) {
     printf(" error with text\n"
            " expected: %s\n"
-           "   actual: %.*s\n", err, (int)v.data.string.len, v.data.string.data);
+           "   actual: %.*s\n", err, (int)s.len, s.data);
     return false;
   }
   return true;
 }
 
 bool is_str(KVal v, const char *str) {
+  KString s = kval_str(&v);
   if (v.type != KT_STRING)
     goto not_string;
-  if (strlen(str) != v.data.string.len ||
-      memcmp(str, v.data.string.data, v.data.string.len) != 0)
+  if (strlen(str) != s.len || memcmp(str, s.data, s.len) != 0)
     goto not_the_same;
   return true;
 
@@ -83,7 +84,7 @@ bool is_str(KVal v, const char *str) {
    printf(" expected: %s\n"
           "   actual: %.*s\n",
           str,
-          (int)v.data.string.len, v.data.string.data);
+          (int)s.len, s.data);
    return false;
  }
 
@@ -93,9 +94,9 @@ bool is_num_arr(KVal v, size_t len, double *nums) {
   if (v.data.array->size != len)
     goto size_mismatch;
   for (size_t i = 0; i < len; i++) {
-    if (v.data.array->items[i].data.number != nums[i]) {
+    if (kval_number(v.data.array->items[i]) != nums[i]) {
       printf("  [%zu] expected %f, got %f\n", i, nums[i],
-             v.data.array->items[i].data.number);
+             kval_number(v.data.array->items[i]));
       return false;
     }
   }
@@ -109,6 +110,27 @@ size_mismatch:
   return false;
 }
 
+bool is_vec(KVal v, KType type, size_t len, double *nums) {
+  if (v.type != KT_VECTOR || v.data.vector->type != type) {
+    printf(" expected vector of %s\n", type == KT_INT ? "ints" : "numbers");
+    return false;
+  }
+  if (v.data.vector->size != len) {
+    printf(" expected vector of length %zu, got length %zu\n", len,
+           v.data.vector->size);
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    double n = type == KT_INT ? (double)v.data.vector->items.ints[i]
+                              : v.data.vector->items.numbers[i];
+    if (n != nums[i]) {
+      printf("  [%zu] expected %f, got %f\n", i, nums[i], n);
+      return false;
+    }
+  }
+  return true;
+}
+
 bool is_str_arr(KVal v, size_t len, const char **strs) {
   if (v.type != KT_ARRAY)
     goto not_array;
@@ -128,18 +150,66 @@ size_mismatch:
   return false;
 }
 
+bool gc_tuned(KCtx *ctx, double growth, size_t min_heap) {
+  KGcTuning t;
+  kokoki_gc_tuning(ctx, &t);
+  return t.growth == growth && t.min_heap == min_heap;
+}
+
 bool is_num(KVal v, double num) {
-  if (v.type != KT_NUMBER) {
+  if (v.type != KT_NUMBER && v.type != KT_INT) {
     printf(" expected number\n");
     return false;
   }
-  if (v.data.number != num) {
-    printf(" expected %f, got %f\n", num, v.data.number);
+  if (kval_number(v) != num) {
+    printf(" expected %f, got %f\n", num, kval_number(v));
     return false;
   }
   return true;
 }
 
+/* Feed src to a reader chunk bytes at a time, gives TEST an empty source */
+const char *fed(KCtx *ctx, const char *src, size_t chunk) {
+  KReader r = {0};
+  size_t len = strlen(src);
+  for (size_t i = 0; i < len; i += chunk)
+    kokoki_feed(ctx, &r, src + i, len - i < chunk ? len - i : chunk);
+  kokoki_feed_end(ctx, &r);
+  return "";
+}
+
+/* True if evaluating src prints out, colors left out */
+bool prints(KCtx *ctx, const char *src, const char *out) {
+  char buf[256] = {0}, text[256];
+  FILE *tmp = tmpfile();
+  fflush(stdout);
+  int saved = dup(1);
+  dup2(fileno(tmp), 1);
+  kokoki_eval(ctx, src);
+  fflush(stdout);
+  dup2(saved, 1);
+  close(saved);
+  rewind(tmp);
+  size_t n = fread(buf, 1, sizeof(buf) - 1, tmp), len = 0;
+  fclose(tmp);
+  for (size_t i = 0; i < n; i++) {
+    if (buf[i] == '\x1b')
+      while (i < n && buf[i] != 'm')
+        i++;
+    else
+      text[len++] = buf[i];
+  }
+  text[len] = 0;
+  if (strcmp(text, out)) {
+    printf(" printed \"%s\"\n", text);
+    return false;
+  }
+  return true;
+}
+
+#define fed_src                                                                \
+  ": sq dup * ;\n[1 \"a ] b\" ']' ] len nip # [ comment\n 3 sq (a [ b) +"
+
 #define age_check                                                              \
   "[ [dup 10 <] \"child\""                                                     \
   "  [dup 25 <] \"young adult\""                                               \
@@ -148,7 +218,7 @@ bool is_num(KVal v, double num) {
 
 void run_native_tests(KCtx *ctx) {
   TEST("comment", "# this is a comment\n 1 2 3 + # and so is this\n+", 1,
-       top.data.number == 6);
+       is_num(top, 6));
   TEST("pick1", "1 2 3 0 pick", 4, is_num(top, 3));
   TEST("pick2", "1 2 3 2 pick", 4, is_num(top, 1));
   TEST("pick err", "1 2 42 pick", 3,
@@ -163,7 +233,20 @@ void run_native_tests(KCtx *ctx) {
 
   TEST("define value", ": pi 3.1415 ; 2 pi *", 1, is_num(top, 6.283));
   TEST("define code", ": squared dup * ; 3 squared", 1, is_num(top, 9));
-
+  TEST("redefine", ": foo 1 ; : bar foo ; : foo 2 ; bar", 1, is_num(top, 2));
+  TEST("forward ref", ": fwd later ; : later 42 ; fwd", 1, is_num(top, 42));
+
+  TEST("int div", "84 2 /", 1, top.type == KT_INT && is_num(top, 42));
+  TEST("frac div", "7 2 /", 1, top.type == KT_NUMBER && is_num(top, 3.5));
+  TEST("mixed", "1 0.5 + 2 *", 1, is_num(top, 3));
+  TEST("mod", "-7 3 %", 1, top.type == KT_INT && is_num(top, -1));
+  TEST("mod by zero", "7 0 %", 1, is_error(top, "Division by zero"));
+  TEST("int = double", "2 2.0 =", 1, top.type == KT_TRUE);
+  TEST("non number", "1 \"a\" +", 1,
+       is_error(top, "Expected two numbers for +"));
+  TEST("underflow", "1 +", 2, is_error(top, "Stack underflow!"));
+  TEST("swap underflow", "swap", 1, is_error(top, "Stack underflow!"));
+  TEST("stack growth", "[1] 5000 times [+] 4999 times", 1, is_num(top, 5000));
   TEST("compare <", "7 10 <", 1, top.type == KT_TRUE);
   TEST("compare >", "7 10 >", 1, top.type == KT_FALSE);
 
@@ -172,10 +255,32 @@ void run_native_tests(KCtx *ctx) {
   TEST("cond2", "22 " age_check, 2, is_str(top, "young adult"));
   TEST("cond3", "44 " age_check, 2, is_str(top, "adult"));
   TEST("cond fallback", "123 " age_check, 2, is_str(top, "older adult"));
+  TEST("cond no match", "[ false 1 nil 2 ] cond", 0, true);
+  TEST("deep recursion",
+       ": down [ [dup 0 =] [] true [1 - down] ] cond ; 100000 down", 1,
+       is_num(top, 0));
+  TEST("tail call",
+       ": down [ [dup 0 =] [] true [1 - down] ] cond ; 1000000 down", 1,
+       is_num(top, 0));
+  TEST("tail call through if",
+       ": down (n -- 0) dup 0 = not [1 - down] if ; 1000000 down", 1,
+       is_num(top, 0));
+  TEST("tail call through exec",
+       ": down dup 0 = not [1 - [down] exec] if ; 1000000 down", 1,
+       is_num(top, 0));
+  TEST("while tail", "0 [1 + dup 1000000 <] while", 1, is_num(top, 1000000));
 
   TEST("slurp", "\".test/small.txt\" slurp", 1,
        is_str(top, "Korvatunturin Konkatenatiivinen Kieli\n"));
 
+  TEST("slurp missing", "\".test/nope.txt\" slurp", 1,
+       is_error(top, "Can't read file .test/nope.txt: No such file or directory"));
+  TEST("read-line", "\".test/lines.txt\" open read-line swap read-line nip", 2,
+       is_str(top, "second") && is_str(bot, "first"));
+  TEST("read-line eof", "\".test/small.txt\" open read-line drop read-line nip", 1,
+       top.type == KT_NIL);
+  TEST("each-line", "0 \".test/lines.txt\" [len nip +] each-line", 1,
+       is_num(top, 34));
   TEST("each", "[1 2 3] [2 *] each", 1,
        is_num_arr(top, 3, (double[]){2, 4, 6}));
   TEST("each2", ": inc 1 + ; [41 665] [inc] each", 1,
@@ -186,12 +291,37 @@ void run_native_tests(KCtx *ctx) {
   TEST("cat", "\"foo\" \"bar\" cat", 1, is_str(top, "foobar"));
   TEST("cat num 1", "\"foo\" 33 cat", 1, is_str(top, "foo!"));
   TEST("cat num 2", "33 \"foo\" cat", 1, is_str(top, "!foo"));
+  TEST("cat past small", "\"0123456789abcdefghijklmn\" \"op\" cat", 1,
+       is_str(top, "0123456789abcdefghijklmnop"));
 
   TEST("fold cat", "[\"foo\" \"bar\" \"baz\"] [cat] fold", 1,
        is_str(top, "foobarbaz"));
 
   TEST("filter even", "[1 2 3 6 8 41] [2 % 0 =] filter", 1,
        is_num_arr(top, 3, (double[]){2, 6, 8}));
+  TEST("fused ops", "[3 10 15 20] [dup 5 % 0 = swap 1 + drop] filter", 1,
+       is_num_arr(top, 3, (double[]){10, 15, 20}));
+  TEST("peach", "[1 2 3] [2 *] peach", 1,
+       is_num_arr(top, 3, (double[]){2, 4, 6}));
+  TEST("pfilter", "[1 2 3 6 8 41] [2 % 0 =] pfilter", 1,
+       is_num_arr(top, 3, (double[]){2, 6, 8}));
+  TEST("preduce", "[1 2 3 0] [+] preduce", 1, is_num(top, 6));
+  TEST("peach split", "0 5000 range into-array [2 *] peach [+] fold", 1,
+       is_num(top, 24995000));
+  TEST("pfilter split",
+       "0 5000 range into-array [2 % 0 =] pfilter len nip", 1,
+       is_num(top, 2500));
+  TEST("preduce split", "0 5000 range into-array [+] preduce", 1,
+       is_num(top, 12497500));
+  TEST("parallel again after gc",
+       "0 2000 range into-array [drop \"a string longer than inline\"] peach "
+       "[gc 0 2000 range into-array [drop \"another long string\"] peach drop] "
+       "10 times 1999 aget nip",
+       1, is_str(top, "a string longer than inline"));
+  TEST("parallel big",
+       "[] 0 [swap over apush swap 1 +] 100000 times drop "
+       "[2 *] peach [3 % 0 =] pfilter len swap [+] preduce",
+       2, is_num(bot, 33334) && is_num(top, 3333366666));
   TEST("not1", "1 2 < not", 1, top.type == KT_FALSE);
   TEST("not2", "false not", 1, top.type == KT_TRUE);
   TEST("not3", "nil not", 1, top.type == KT_TRUE);
@@ -199,6 +329,40 @@ void run_native_tests(KCtx *ctx) {
 
   TEST("apush", "[ 1 2 ] 3 apush", 1, is_num_arr(top, 3, (double[]){1, 2, 3}));
   TEST("len", "[1 2 3] len", 2, is_num(top, 3));
+  TEST("hashmap literal", "{\"foo\" 42 \"bar\" 666} \"bar\" hmget", 2,
+       is_num(top, 666));
+  TEST("hmget missing", "{} 1 hmget", 2, top.type == KT_NIL);
+  TEST("hmput overwrite", "{} 1 2 hmput 1 3 hmput len", 2, is_num(top, 1));
+  TEST("hmdel", "{1 2 3 4} 1 hmdel 1 hmget swap 3 hmget", 3,
+       is_num(top, 4) && ctx->stack->items[0].type == KT_NIL);
+  TEST("hashmap many",
+       "{} 0 [swap over dup hmput swap 1 +] 20000 times drop "
+       "0 [swap over hmdel swap 2 +] 10000 times drop len swap drop",
+       1, is_num(top, 10000));
+  TEST("name eq", "[foo] 0 aget swap drop [foo] 0 aget swap drop =", 1,
+       top.type == KT_TRUE);
+  TEST("name neq", "[foo] 0 aget swap drop [@foo] 0 aget swap drop =", 1,
+       top.type == KT_FALSE);
+  TEST("array key", "{[1 2] \"a\" [2 1] \"b\"} [1 2] hmget", 2,
+       is_str(top, "a"));
+  TEST("array key mixed numbers", "{[1 2] \"a\"} [1.0 2] hmget", 2,
+       is_str(top, "a"));
+  TEST("big int and double", "9007199254740993 9007199254740992.0 =", 1,
+       top.type == KT_FALSE);
+  TEST("big int key and double",
+       "{9007199254740993 \"x\" 9007199254740992 \"y\"} "
+       "dup 9007199254740992.0 hmget nip swap 9007199254740993.0 hmget nip",
+       2, is_str(bot, "y") && is_str(top, "y"));
+  TEST("hashmap key", "{{1 2 3 4} 42} {3 4 1 2} hmget", 2, is_num(top, 42));
+  TEST("modified after hash",
+       "[1 2] [1 2 3] {} 2 pick hmget drop over hmget drop drop "
+       "swap 3 apush =",
+       1, top.type == KT_TRUE);
+  TEST("resolved after hash",
+       ": rw 1 ; [rw] {} over 1 hmput drop dup 1 times drop "
+       "[rw] dup 1 times drop {} over 1 hmput drop =",
+       1, top.type == KT_TRUE);
+  TEST("hashmap eq", "{1 2 3 4} {3 4 1 2} =", 1, top.type == KT_TRUE);
   TEST("aget", "[1 2 3] 1 aget", 2, is_num(top, 2));
   TEST("aget str", "\"foo!\" 3 aget", 2, is_num(top,33));
   TEST("aset", "[1 2 3] 1 42 aset", 1,
@@ -207,6 +371,23 @@ void run_native_tests(KCtx *ctx) {
   TEST("aget oob", "[1 2] 5 aget", 2,
        is_error(top, "Index out of bounds 5 (0 - 1 inclusive)"));
   TEST("adel", "[1 2 3 4] 2 adel", 1, is_num_arr(top, 3, (double[]){1,2,4}));
+  TEST("adel front", "[1 2 3 4 5] 1 adel 0 adel", 1,
+       is_num_arr(top, 3, (double[]){3, 4, 5}));
+  TEST("adel oob", "[1 2] 2 adel", 2,
+       is_error(top, "Index out of bounds 2 (0 - 1 inclusive)"));
+  TEST("apop", "[1 2 3] apop", 2,
+       is_num(top, 3) && is_num_arr(bot, 2, (double[]){1, 2}));
+  TEST("apop empty", "[] apop", 2, is_error(top, "Can't pop from empty array"));
+  TEST("apush-front", "[2 3] 1 apush-front 0 apush-front", 1,
+       is_num_arr(top, 4, (double[]){0, 1, 2, 3}));
+  TEST("apop-front", "[1 2 3] apop-front", 2,
+       is_num(top, 1) && is_num_arr(bot, 2, (double[]){2, 3}));
+  TEST("queue",
+       "[] 0 [swap over apush over apush apop-front drop swap 1 +] 1000 times "
+       "drop 0 aget swap len swap drop",
+       2, is_num(bot, 500) && is_num(top, 1000));
+  TEST("deque", "[] [1 apush-front 2 apush] 100 times apop-front swap apop swap drop",
+       2, is_num(top, 2) && is_num(bot, 1));
 
   TEST("times1", "3 4 times + + +", 1, is_num(top, 12));
   TEST("times2", "[] [6 apush] 3 times", 1,
@@ -221,6 +402,7 @@ void run_native_tests(KCtx *ctx) {
   TEST("swap ref value", "@x 4.2 ! @x [10 *] !?", 1, is_num(top, 42));
 
   TEST("eval", "\"4.2 10 *\" eval", 1, is_num(top, 42));
+  TEST("eval loop", "0 [\"3 +\" eval] 1000 times", 1, is_num(top, 3000));
 
   TEST("and1", "1 2 and", 1, top.type == KT_TRUE);
   TEST("and2", "1 false and", 1, top.type == KT_FALSE);
@@ -228,6 +410,27 @@ void run_native_tests(KCtx *ctx) {
 
   TEST("rev", "[1 2 3] reverse", 1, is_num_arr(top, 3, (double[]){3, 2, 1}));
   TEST("rev str", "\"foobar\" reverse", 1, is_str(top, "raboof"));
+  TEST("rev empty str", "\"\" reverse", 1, is_str(top, ""));
+  TEST("rev empty", "[] reverse", 1, is_num_arr(top, 0, NULL));
+  TEST("rev even", "[1 2 3 4] reverse", 1,
+       is_num_arr(top, 4, (double[]){4, 3, 2, 1}));
+  TEST("slice shares", "\"foobar\" 1 4 slice 1 2 slice nip nip", 1,
+       is_str(top, "o"));
+  TEST("long slice", "\"0123456789abcdefghijklmnop\" 1 26 slice nip", 1,
+       is_str(top, "123456789abcdefghijklmnop"));
+  TEST("long slice of slice",
+       "\"0123456789abcdefghijklmnopqrstuvwxyz\" 2 30 slice nip 3 25 slice nip",
+       1, is_str(top, "56789abcdefghijklmnopq"));
+  TEST("slice outlives string",
+       "\"0123456789\" \"abcdefghij\" cat \"ABCDEFGHIJ\" cat 5 25 slice nip gc",
+       1, is_str(top, "56789abcdefghijABCDE"));
+  TEST("values stay small", "", 0, sizeof(KVal) <= 3 * sizeof(void *));
+  TEST("grow literal", "[1 2] 3 apush 4 apush", 1,
+       is_num_arr(top, 4, (double[]){1, 2, 3, 4}));
+  TEST("grow slice", "[1 2 3] 1 3 slice nip 4 apush", 1,
+       is_num_arr(top, 3, (double[]){2, 3, 4}));
+  TEST("each on slice", "\"foobar\" 0 3 slice [1 +] each cat", 1,
+       is_str(top, "foobargpp"));
 
   TEST("sort", "[666 12 42 0] sort", 1,
        is_num_arr(top, 4, (double[]){0, 12, 42, 666}));
@@ -235,6 +438,174 @@ void run_native_tests(KCtx *ctx) {
        is_str_arr(top, 2, (const char *[]){"Afoobar", "foo"}));
   TEST("sort strings2", "[\"foobar\" \"foo\"] sort", 1,
        is_str_arr(top, 2, (const char *[]){"foo", "foobar"}));
+  TEST("sort numbers", "[2.5 -1 0.5 -3.25 2] sort", 1,
+       is_num_arr(top, 5, (double[]){-3.25, -1, 0.5, 2, 2.5}));
+  TEST("sort long strings",
+       "[\"prefix-long-b\" \"prefix-long-a\" \"prefix-lo\" \"a\"] sort", 1,
+       is_str_arr(top, 4, (const char *[]){"a", "prefix-lo", "prefix-long-a",
+                                           "prefix-long-b"}));
+  TEST("sort mixed", "[\"b\" 2 \"a\" 1] sort", 1,
+       is_num(top.data.array->items[0], 1) &&
+       is_num(top.data.array->items[1], 2) &&
+       is_str(top.data.array->items[2], "a"));
+  TEST("sort many",
+       "[] copy 0 [dup 37 * 101 % 50 - rot swap apush swap 1 +] 100 times "
+       "drop sort 0 aget swap 64 aget swap 99 aget nip", 3,
+       is_num(bot, -50) && is_num(ctx->stack->items[1], 15) &&
+       is_num(top, 50));
+  TEST("sort many numbers",
+       "[] copy 0 [dup 37 * 101 % 50 - 0.5 * rot swap apush swap 1 +] 100 "
+       "times drop sort 0 aget swap 64 aget swap 99 aget nip", 3,
+       is_num(bot, -25) && is_num(ctx->stack->items[1], 7.5) &&
+       is_num(top, 25));
+  TEST("range", "0 5 range into-array", 1,
+       is_num_arr(top, 5, (double[]){0, 1, 2, 3, 4}));
+  TEST("range empty", "5 5 range into-array", 1, is_num_arr(top, 0, NULL));
+  TEST("range fold", "1 101 range [+] fold", 1, is_num(top, 5050));
+  TEST("range pipeline",
+       "1 1000000 range [3 *] map [2 % 0 =] filter 5 take [+] fold", 1,
+       is_num(top, 6 + 12 + 18 + 24 + 30));
+  TEST("range each", "0 1 4 range [+] each", 1, is_num(top, 6));
+  TEST("range again", "0 3 range dup [+] fold swap [+] fold", 2,
+       is_num(bot, 3) && is_num(top, 3));
+  TEST("map array", "[1 2 3] [10 *] map into-array", 1,
+       is_num_arr(top, 3, (double[]){10, 20, 30}));
+  TEST("map keeps array", "[1 2 3] dup [10 *] map drop", 1,
+       is_num_arr(top, 3, (double[]){1, 2, 3}));
+  TEST("map string", "\"abc\" [1 +] map into-array", 1,
+       is_num_arr(top, 3, (double[]){'b', 'c', 'd'}));
+  TEST("map vector", "[1.5 2.5] numbers [2 *] map [+] fold", 1,
+       is_num(top, 8));
+  TEST("seq filter", "[1 2 3 4] seq [2 % 1 =] filter into-array", 1,
+       is_num_arr(top, 2, (double[]){1, 3}));
+  TEST("take", "[1 2 3] 2 take into-array", 1,
+       is_num_arr(top, 2, (double[]){1, 2}));
+  TEST("file lines seq", "0 \".test/lines.txt\" open [len nip] map [+] fold +",
+       1, is_num(top, 34));
+  TEST("map not items", "42 [1 +] map", 1,
+       is_error(top, "Expected array, string, vector, file or sequence"));
+  TEST("ints", "[1 2.5 -3] ints", 1,
+       is_vec(top, KT_INT, 3, (double[]){1, 2, -3}));
+  TEST("numbers", "[1 2.5 -3] numbers", 1,
+       is_vec(top, KT_NUMBER, 3, (double[]){1, 2.5, -3}));
+  TEST("numbers zeros", "3 numbers", 1,
+       is_vec(top, KT_NUMBER, 3, (double[]){0, 0, 0}));
+  TEST("numbers not numbers", "[1 \"a\"] numbers", 1,
+       is_error(top, "Expected only numbers in array, item 1 is not"));
+  TEST("vec->array", "[1 2] ints vec->array", 1,
+       is_num_arr(top, 2, (double[]){1, 2}));
+  TEST("vector plus", "[1 2 3] ints [10 20 30] ints +", 1,
+       is_vec(top, KT_INT, 3, (double[]){11, 22, 33}));
+  TEST("vector scalar", "[1 2 3] ints 2 *", 1,
+       is_vec(top, KT_INT, 3, (double[]){2, 4, 6}));
+  TEST("scalar vector", "10 [1 2 3] ints -", 1,
+       is_vec(top, KT_INT, 3, (double[]){9, 8, 7}));
+  TEST("vector mixed", "[1 2 3] ints 0.5 +", 1,
+       is_vec(top, KT_NUMBER, 3, (double[]){1.5, 2.5, 3.5}));
+  TEST("vector divide", "[1 2 3] ints 2 /", 1,
+       is_vec(top, KT_NUMBER, 3, (double[]){0.5, 1, 1.5}));
+  TEST("vector compare", "[1 5 3] ints 2 >", 1,
+       is_vec(top, KT_INT, 3, (double[]){0, 1, 1}));
+  TEST("vector sizes", "[1 2] ints [1 2 3] ints +", 1,
+       is_error(top, "Vectors have different sizes (2 and 3)"));
+  TEST("vector and string", "[1 2] ints \"a\" +", 1,
+       is_error(top, "Expected vectors or numbers"));
+  TEST("sum", "[1 2 3 4 5] ints sum", 1, is_num(top, 15));
+  TEST("sum numbers", "[0.5 1 1.5 2 2.5] numbers sum", 1, is_num(top, 7.5));
+  TEST("dot", "[1 2 3] ints [4 5 6] numbers dot", 1, is_num(top, 32));
+  TEST("min max", "[3 -1 7] ints dup min swap max", 2,
+       is_num(bot, -1) && is_num(top, 7));
+  TEST("min empty", "[] numbers min", 1,
+       is_error(top, "Expected a vector with numbers"));
+  TEST("vector len aget", "[4 5 6] ints len swap 1 aget nip", 2,
+       is_num(bot, 3) && is_num(top, 5));
+  TEST("vector aset", "[4 5 6] ints 1 2.5 aset", 1,
+       is_vec(top, KT_INT, 3, (double[]){4, 2, 6}));
+  TEST("vector aset bounds", "[4 5 6] ints 3 1 aset", 2,
+       is_error(top, "Index out of bounds 3 (0 - 2 inclusive)"));
+  TEST("vector slice", "[4 5 6 7] numbers 1 3 slice nip", 1,
+       is_vec(top, KT_NUMBER, 2, (double[]){5, 6}));
+  TEST("vector filter mask", "[4 5 6 7] ints dup 5 > filter", 1,
+       is_vec(top, KT_INT, 2, (double[]){6, 7}));
+  TEST("array filter mask", "[\"a\" \"b\" \"c\"] [1 0 1] ints filter", 1,
+       is_str_arr(top, 2, (const char *[]){"a", "c"}));
+  TEST("vector filter code", "[4 5 6 7] ints [2 % 0 =] filter", 1,
+       is_vec(top, KT_INT, 2, (double[]){4, 6}));
+  TEST("vector equals", "[1 2] ints [1.0 2.0] numbers =", 1,
+       top.type == KT_TRUE);
+  TEST("vector key", "{} [1 2] ints 42 hmput [1 2] numbers hmget nip", 1,
+       is_num(top, 42));
+  TEST("vector in array changed",
+       "[1 2] ints dup 1 array {} over 1 hmput drop "
+       "swap 0 9 aset drop [9 2] ints 1 array {} over 1 hmput drop =",
+       1, top.type == KT_TRUE);
+  TEST("vector copy", "[1 2] ints copy 0 9 aset", 1,
+       is_vec(top, KT_INT, 2, (double[]){9, 2}));
+  TEST("sort-by", "[\"ccc\" \"a\" \"bb\"] [len nip] sort-by", 1,
+       is_str_arr(top, 3, (const char *[]){"a", "bb", "ccc"}));
+  TEST("sort-by negated", "[3 1 2] [0 swap -] sort-by", 1,
+       is_num_arr(top, 3, (double[]){3, 2, 1}));
+  TEST("feed bytes", fed(ctx, fed_src, 1), 1, is_num(top, 12));
+  TEST("feed chunks", fed(ctx, fed_src, 5), 1, is_num(top, 12));
+  KReader r = {0};
+  kokoki_feed(ctx, &r, "40 2 + : fed-answer", 19);
+  TEST("feed runs complete forms", "", 1,
+       is_num(top, 42) && kokoki_reader_pending(&r));
+  kokoki_feed(ctx, &r, " 42 ;\nfed-answer\n", 17);
+  TEST("feed definition over chunks", "", 1,
+       is_num(top, 42) && !kokoki_reader_pending(&r));
+  kokoki_feed_end(ctx, &r);
+  TEST("unterminated array", "1 [2 3", 1, is_num(top, 1));
+  TEST("unterminated definition", ": foo 1", 0, 1);
+  TEST("unterminated hashmap", "1 {2 3", 1, is_num(top, 1));
+  TEST("error in hashmap", "1 {2 [3 } 4", 1, is_num(top, 1));
+  TEST("unterminated string", "\"abc", 1, is_str(top, "abc"));
+  TEST("parse fraction exactly", "13.866257 3.231047 0.1234567890123456789", 3,
+       is_num(ctx->stack->items[0], 13.866257) &&
+           is_num(ctx->stack->items[1], 3.231047) &&
+           is_num(top, 0.1234567890123456789));
+  TEST("parse long number", "123456789012345678901234567890", 1,
+       is_num(top, 123456789012345678901234567890.0));
+  TEST("print numbers", "", 0,
+       prints(ctx, "42 . \" \" . -7 . \" \" . 3.0 . \" \" . 2.5 . nl", "42 -7 3 2.5\n"));
+  TEST("print shortest", "", 0,
+       prints(ctx, "0.1 0.2 + . \" \" . 13.866257 . \" \" . 1 3.0 / .",
+              "0.30000000000000004 13.866257 0.3333333333333333"));
+  TEST("print big", "", 0,
+       prints(ctx, "9223372036854775807 . \" \" . 100000000000000000000.0 .",
+              "9223372036854775807 1e+20"));
+  TEST("push to one item literal", "[1] 2 apush", 1,
+       is_num_arr(top, 2, (double[]){1, 2}));
+  TEST("push to one item slice", "[1 2 3] 0 1 slice nip 5 apush", 1,
+       is_num_arr(top, 2, (double[]){1, 5}));
+  TEST("push to one item split", "\"a\" \",\" split \"b\" apush", 1,
+       is_str_arr(top, 2, (const char *[]){"a", "b"}));
+  TEST("copy aset", "[1 2 3] dup copy 0 9 aset", 2,
+       is_num_arr(top, 3, (double[]){9, 2, 3}) &&
+           is_num_arr(bot, 3, (double[]){1, 2, 3}));
+  TEST("copy original changed", "[1 2] dup copy swap 0 9 aset", 2,
+       is_num_arr(top, 2, (double[]){9, 2}) &&
+           is_num_arr(bot, 2, (double[]){1, 2}));
+  TEST("copy apush", "[1 2] dup copy copy 3 apush", 2,
+       is_num_arr(top, 3, (double[]){1, 2, 3}) &&
+           is_num_arr(bot, 2, (double[]){1, 2}));
+  TEST("copy each", "[1 2] dup copy [10 *] each", 2,
+       is_num_arr(top, 2, (double[]){10, 20}) &&
+           is_num_arr(bot, 2, (double[]){1, 2}));
+  TEST("copy shifted", "[1 2 3] dup 0 adel drop copy 4 apush", 1,
+       is_num_arr(top, 3, (double[]){2, 3, 4}));
+  TEST("copy empty literal", ": fresh [] copy ; fresh 1 apush drop fresh", 1,
+       is_num_arr(top, 0, NULL));
+  TEST("copy hashmap", "{\"a\" 1} dup copy \"a\" 2 hmput drop \"a\" hmget nip",
+       1, is_num(top, 1));
+  TEST("copy empty hashmap", ": fresh {} copy ; fresh 1 2 hmput drop fresh len",
+       2, is_num(top, 0));
+  TEST("copy string", "\"abc\" copy", 1, is_str(top, "abc"));
+  TEST("if compiled", ": sgn dup 0 < [drop -1] [0 > [1] [0] if-else] if-else ; "
+       "-5 sgn 7 sgn 0 sgn 3 array", 1,
+       is_num_arr(top, 3, (double[]){-1, 1, 0}));
+  TEST("if code from stack", ": run-if if ; 1 true [1 +] run-if 2 false [1 +] run-if",
+       2, is_num(top, 2) && is_num(bot, 2));
 
 
 }
@@ -277,20 +648,102 @@ void run_stdlib_tests(KCtx *ctx) {
   TEST("split-at", "\"nope\" ' ' split-at", 2,
        is_str(bot, "nope") && is_str(top, ""));
 
+  TEST("use",
+       "@module-loads 0 ! \".test/module.ki\" use "
+       "module-word @module-loads ?",
+       2, is_num(bot, 42) && is_num(top, 1));
+  TEST("use again", "\"./.test/module.ki\" use @module-loads ?", 1,
+       is_num(top, 1));
+  TEST("use missing", "\".test/nope.ki\" use", 1, top.type == KT_ERROR);
+  TEST("use in peach",
+       "0 5000 range into-array [drop \".test/module.ki\" use module-word] "
+       "peach [+] fold @module-loads ?",
+       2, is_num(bot, 210000) && is_num(top, 1));
+  TEST("profile", ": psq dup * ; [0 [3 psq +] 10000 times] profile", 1,
+       is_num(top, 90000) && !ctx->profiling);
+  TEST("profile folded",
+       "\"/tmp/kokoki-test.folded\" profile-folded "
+       "\"/tmp/kokoki-test.folded\" slurp lines len",
+       2, top.type == KT_INT && top.data.integer > 0);
+  TEST("profile reset", "profile-reset", 0, ctx->profile == NULL);
+  TEST("gc-stats", "gc-stats \"objects\" hmget nip", 1,
+       top.type == KT_INT && top.data.integer > 0);
+  TEST("gc",
+       "gc-stats \"collections\" hmget nip gc "
+       "gc-stats \"collections\" hmget nip swap -",
+       1, top.type == KT_INT && top.data.integer >= 1);
+  TEST("gc-tune", "{\"growth\" 2 \"min-heap\" 4000000} gc-tune", 0,
+       gc_tuned(ctx, 2, 4000000));
+  TEST("gc-tune unknown", "{\"speed\" 2} gc-tune", 1,
+       top.type == KT_ERROR && gc_tuned(ctx, 2, 4000000));
+  TEST("gc-tune negative", "{\"growth\" -1} gc-tune", 1,
+       top.type == KT_ERROR && gc_tuned(ctx, 2, 4000000));
+  TEST("gc-tune back", "{\"growth\" 0.5 \"min-heap\" 1048576} gc-tune", 0,
+       gc_tuned(ctx, 0.5, 1048576));
   TEST("lines", "\".test/lines.txt\" slurp lines", 1,
        is_str_arr(top, 5,
                   (const char*[]){"first", "second", "third", "",
                                   "fourth after empty"}));
+  FILE *big = fopen("/tmp/kokoki-test-big.txt", "w");
+  for (int i = 0; i < 5000; i++)
+    fprintf(big, "line %d of the mapped test file\n", i);
+  fclose(big);
+  TEST("lines of mapped file",
+       "\"/tmp/kokoki-test-big.txt\" slurp lines 4321 aget nip "
+       "dup 5 30 slice nip",
+       2, is_str(bot, "line 4321 of the mapped test file") &&
+              is_str(top, "4321 of the mapped test f"));
+  TEST("lines no newline", "\"a\" 10 cat 10 cat \"b\" cat lines", 1,
+       is_str_arr(top, 3, (const char *[]){"a", "", "b"}));
+  TEST("ch-idx", "\"foo,bar\" ',' ch-idx", 2, is_num(top, 3));
+  TEST("ch-idx missing", "\"foo\" ',' ch-idx", 2, is_num(top, -1));
+  TEST("split", "\"a, b,, c\" \", \" split", 1,
+       is_str_arr(top, 3, (const char *[]){"a", "b,", "c"}));
+  TEST("join", "[\"a\" \"b\" \"c\"] \"--\" join", 1, is_str(top, "a--b--c"));
+  TEST("join empty", "[] \",\" join", 1, is_str(top, ""));
+
+}
 
+void run_instance_tests(KCtx *main_ctx) {
+  KCtx *ctx = kokoki_new(NULL);
+  TEST("new instance", ": answer 42 ; answer 1 [1 +] 1000 times", 2,
+       is_num(bot, 42) && is_num(top, 1001));
+  TEST("redefine fused word", ": t 3 + ; 1 t : + * ; 2 t", 2,
+       is_num(bot, 4) && is_num(top, 6));
+  TEST("redefine cond", ": c [true 1] cond ; c : cond drop 7 ; c", 2,
+       is_num(bot, 1) && is_num(top, 7));
+  TEST("redefine if", ": f true [1] if ; f : if drop drop 9 ; f", 2,
+       is_num(bot, 1) && is_num(top, 9));
+  TEST("redefine if-else",
+       ": g false [1] [2] if-else ; g : if-else drop drop drop 8 ; g", 2,
+       is_num(bot, 2) && is_num(top, 8));
+  kokoki_free(ctx);
+  ctx = main_ctx;
+  TEST("instances don't share words", "answer", 0, true);
+
+  TEST("define for clone",
+       ": clone-fact dup 1 > [dup 1 - clone-fact *] [drop 1] if-else ; "
+       ": clone-msg \"a string longer than inline ones\" ;", 0, true);
+  ctx = kokoki_clone(main_ctx);
+  TEST("clone has words", "5 clone-fact clone-msg len", 3,
+       is_num(bot, 120) && is_num(top, 32));
+  TEST("clone has stdlib", "1 2 3 3 array", 1,
+       is_num_arr(top, 3, (double[]){1, 2, 3}));
+  TEST("redefine in clone", ": clone-msg 1 ; clone-msg", 1, is_num(top, 1));
+  kokoki_free(ctx);
+  ctx = main_ctx;
+  TEST("clone doesn't change original", "clone-msg len", 2, is_num(top, 32));
 }
 
 void run_tests(KCtx *ctx, void *user) {
   run_native_tests(ctx);
   run_stdlib_tests(ctx);
+  run_instance_tests(ctx);
 }
 
 int main(int argc, char **argv) {
-  kokoki_init(run_tests,NULL);
+  // parallel words split work even on one core
+  kokoki_init_opts(&(KOptions){.threads = 4}, run_tests, NULL);
   printf("\n%d success\n", success);
   if (fails) {
     fprintf(stderr, "%d failures!\n", fails);
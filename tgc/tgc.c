@@ -1,4 +1,18 @@
 #include "tgc.h"
+#include <time.h>
+
+static double tgc_clock(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void tgc_count(tgc_t *gc, double start) {
+  double pause = tgc_clock() - start;
+  gc->ncollections++;
+  gc->gctime += pause;
+  if (pause > gc->maxpause) { gc->maxpause = pause; }
+}
 
 static size_t tgc_hash(void *ptr) {
     uintptr_t ad = (uintptr_t) ptr;
@@ -70,6 +84,7 @@ static void tgc_rem_ptr(tgc_t *gc, void *ptr) {
     h = gc->items[i].hash;
     if (h == 0 || j > tgc_probe(gc, i, h)) { return; }
     if (gc->items[i].ptr == ptr) {
+      gc->nbytes -= gc->items[i].size;
       memset(&gc->items[i], 0, sizeof(tgc_ptr_t));
       j = i;
       while (1) { 
@@ -256,6 +271,7 @@ void tgc_sweep(tgc_t *gc) {
     if (gc->items[i].flags & TGC_ROOT) { i++; continue; }
     
     gc->frees[k] = gc->items[i]; k++;
+    gc->nbytes -= gc->items[i].size;
     memset(&gc->items[i], 0, sizeof(tgc_ptr_t));
     
     j = i;
@@ -282,7 +298,10 @@ void tgc_sweep(tgc_t *gc) {
   
   tgc_resize_less(gc);
   
-  gc->mitems = gc->nitems + (size_t)(gc->nitems * gc->sweepfactor) + 1;
+  /* collecting costs about as much as the live data, so wait until
+     allocations are some fraction of it */
+  gc->mbytes = gc->nbytes + (size_t)(gc->nbytes * gc->sweepfactor);
+  if (gc->mbytes < gc->minbytes) { gc->mbytes = gc->minbytes; }
   
   for (i = 0; i < gc->nfrees; i++) {
     if (gc->frees[i].ptr) {
@@ -297,12 +316,154 @@ void tgc_sweep(tgc_t *gc) {
   
 }
 
+static int tgc_list_push(void ***list, size_t *n, size_t *m, void *ptr) {
+  if (*n == *m) {
+    size_t nm = *m ? *m * 2 : 256;
+    void **nl = realloc(*list, nm * sizeof(void*));
+    if (nl == NULL) { return 0; }
+    *list = nl; *m = nm;
+  }
+  (*list)[(*n)++] = ptr;
+  return 1;
+}
+
+static void tgc_mark_young(tgc_t *gc, void *ptr);
+
+static void tgc_scan_young(tgc_t *gc, tgc_ptr_t *p) {
+  size_t k, n;
+  void **items;
+  if (p->flags & TGC_LEAF) { return; }
+  items = p->ptr; n = p->size/sizeof(void*);
+  for (k = 0; k < n; k++) {
+    tgc_mark_young(gc, items[k]);
+  }
+}
+
+static void tgc_mark_young(tgc_t *gc, void *ptr) {
+  tgc_ptr_t *p;
+  if ((uintptr_t)ptr < gc->minptr
+  ||  (uintptr_t)ptr > gc->maxptr) { return; }
+  p = tgc_get_ptr(gc, ptr);
+  if (p == NULL || (p->flags & (TGC_MARK | TGC_OLD))) { return; }
+  p->flags |= TGC_MARK;
+  tgc_scan_young(gc, p);
+}
+
+static void tgc_mark_young_stack(tgc_t *gc) {
+  void *stk, *bot, *top, *p;
+  bot = gc->bottom; top = &stk;
+  if (bot < top) {
+    for (p = top; p >= bot; p = ((char*)p) - sizeof(void*)) {
+      tgc_mark_young(gc, *((void**)p));
+    }
+  }
+  if (bot > top) {
+    for (p = top; p <= bot; p = ((char*)p) + sizeof(void*)) {
+      tgc_mark_young(gc, *((void**)p));
+    }
+  }
+}
+
+static void tgc_mark_roots(tgc_t *gc, void **roots, size_t nroots) {
+  size_t i;
+  tgc_ptr_t *p;
+  for (i = 0; i < nroots; i++) {
+    p = tgc_get_ptr(gc, roots[i]);
+    if (p == NULL || (p->flags & TGC_MARK)) { continue; }
+    if (!(p->flags & TGC_OLD)) { p->flags |= TGC_MARK; }
+    tgc_scan_young(gc, p);
+  }
+}
+
+/* Everything left after a collection is old */
+static void tgc_promote_all(tgc_t *gc) {
+  size_t i;
+  for (i = 0; i < gc->nslots; i++) {
+    if (gc->items[i].hash == 0) { continue; }
+    gc->items[i].flags |= TGC_OLD;
+    gc->items[i].flags &= ~TGC_REMEMBERED;
+  }
+  gc->nyoung = 0;
+  gc->nremembered = 0;
+}
+
+void tgc_generational(tgc_t *gc, size_t nursery) {
+  gc->generational = 1;
+  gc->nursery = nursery ? nursery : 1;
+  tgc_promote_all(gc);
+}
+
+void tgc_write(tgc_t *gc, void *ptr) {
+  tgc_ptr_t *p;
+  if (!gc->generational || ptr == NULL) { return; }
+  p = tgc_get_ptr(gc, ptr);
+  if (p == NULL || !(p->flags & TGC_OLD) || (p->flags & TGC_REMEMBERED)
+  ||  (p->flags & TGC_LEAF)) { return; }
+  if (tgc_list_push(&gc->remembered, &gc->nremembered, &gc->mremembered, ptr)) {
+    p->flags |= TGC_REMEMBERED;
+  }
+}
+
+void tgc_minor(tgc_t *gc, void **roots, size_t nroots) {
+
+  size_t i;
+  tgc_ptr_t *p;
+  void *ptr;
+  void (*dtor)(void*);
+  jmp_buf env;
+  void (*volatile mark_stack)(tgc_t*) = tgc_mark_young_stack;
+  double start = tgc_clock();
+
+  for (i = 0; i < gc->nremembered; i++) {
+    p = tgc_get_ptr(gc, gc->remembered[i]);
+    if (p == NULL) { continue; }
+    p->flags &= ~TGC_REMEMBERED;
+    tgc_scan_young(gc, p);
+  }
+  gc->nremembered = 0;
+
+  tgc_mark_roots(gc, roots, nroots);
+
+  memset(&env, 0, sizeof(jmp_buf));
+  setjmp(env);
+  mark_stack(gc);
+
+  for (i = 0; i < gc->nyoung; i++) {
+    ptr = gc->young[i];
+    p = tgc_get_ptr(gc, ptr);
+    if (p == NULL || (p->flags & TGC_OLD)) { continue; }
+    if (p->flags & (TGC_MARK | TGC_ROOT)) {
+      p->flags &= ~TGC_MARK;
+      p->flags |= TGC_OLD;
+      continue;
+    }
+    dtor = p->dtor;
+    tgc_rem_ptr(gc, ptr);
+    if (dtor) { dtor(ptr); }
+    free(ptr);
+  }
+  gc->nyoung = 0;
+  tgc_resize_less(gc);
+  tgc_count(gc, start);
+
+}
+
+void tgc_safepoint(tgc_t *gc, void **roots, size_t nroots) {
+  if (!gc->generational || gc->paused) { return; }
+  if (gc->nbytes > gc->mbytes) {
+    tgc_run(gc);
+  } else if (gc->nyoung >= gc->nursery) {
+    tgc_minor(gc, roots, nroots);
+  }
+}
+
 void tgc_start(tgc_t *gc, void *stk) {
   gc->bottom = stk;
   gc->paused = 0;
   gc->nitems = 0;
   gc->nslots = 0;
-  gc->mitems = 0;
+  gc->nbytes = 0;
+  gc->minbytes = gc->mbytes = TGC_MIN_BYTES;
   gc->nfrees = 0;
   gc->maxptr = 0;
   gc->items = NULL;
@@ -310,12 +471,23 @@ void tgc_start(tgc_t *gc, void *stk) {
   gc->minptr = UINTPTR_MAX;
   gc->loadfactor = 0.9;
   gc->sweepfactor = 0.5;
+  gc->generational = 0;
+  gc->young = NULL;
+  gc->remembered = NULL;
+  gc->nyoung = gc->myoung = 0;
+  gc->nremembered = gc->mremembered = 0;
+  gc->nursery = 0;
+  gc->nallocs = gc->ncollections = gc->allocated = 0;
+  gc->gctime = gc->maxpause = 0;
 }
 
 void tgc_stop(tgc_t *gc) {
+  gc->generational = 0;
   tgc_sweep(gc);
   free(gc->items);
   free(gc->frees);
+  free(gc->young);
+  free(gc->remembered);
 }
 
 void tgc_pause(tgc_t *gc) {
@@ -327,8 +499,11 @@ void tgc_resume(tgc_t *gc) {
 }
 
 void tgc_run(tgc_t *gc) {
+  double start = tgc_clock();
   tgc_mark(gc);
   tgc_sweep(gc);
+  if (gc->generational) { tgc_promote_all(gc); }
+  tgc_count(gc, start);
 }
 
 static void *tgc_add(
@@ -336,19 +511,32 @@ static void *tgc_add(
   int flags, void(*dtor)(void*)) {
 
   gc->nitems++;
+  gc->nallocs++;
+  gc->nbytes += size;
+  gc->allocated += size;
   gc->maxptr = ((uintptr_t)ptr) + size > gc->maxptr ? 
     ((uintptr_t)ptr) + size : gc->maxptr; 
   gc->minptr = ((uintptr_t)ptr)        < gc->minptr ? 
     ((uintptr_t)ptr)        : gc->minptr;
 
   if (tgc_resize_more(gc)) {
-    tgc_add_ptr(gc, ptr, size, flags, dtor);
-    if (!gc->paused && gc->nitems > gc->mitems) {
+    tgc_add_ptr(gc, ptr, size, flags & ~TGC_REMEMBERED, dtor);
+    if (gc->generational) {
+      if (!tgc_list_push(&gc->young, &gc->nyoung, &gc->myoung, ptr)) {
+        /* can't track it as young, keep it as a remembered old block */
+        tgc_set_flags(gc, ptr, (flags & ~TGC_REMEMBERED) | TGC_OLD);
+        flags |= TGC_REMEMBERED;
+      }
+      if (flags & TGC_REMEMBERED) { tgc_write(gc, ptr); }
+    } else if (!gc->paused && gc->nbytes > gc->mbytes) {
       tgc_run(gc);
     }
     return ptr;
   } else {
     gc->nitems--;
+    gc->nallocs--;
+    gc->nbytes -= size;
+    gc->allocated -= size;
     free(ptr);
     return NULL;
   }
@@ -357,7 +545,6 @@ static void *tgc_add(
 static void tgc_rem(tgc_t *gc, void *ptr) {
   tgc_rem_ptr(gc, ptr);
   tgc_resize_less(gc);
-  gc->mitems = gc->nitems + gc->nitems / 2 + 1;
 }
 
 void *tgc_alloc(tgc_t *gc, size_t size) {
@@ -386,6 +573,8 @@ void *tgc_realloc(tgc_t *gc, void *ptr, size_t size) {
   p  = tgc_get_ptr(gc, ptr);
 
   if (p && qtr == ptr) {
+    gc->nbytes = gc->nbytes - p->size + size;
+    if (size > p->size) { gc->allocated += size - p->size; }
     p->size = size;
     return qtr;
   }
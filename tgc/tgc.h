@@ -6,10 +6,17 @@
 #include <string.h>
 #include <setjmp.h>
 
+/* bytes allocated before the first collection */
+#ifndef TGC_MIN_BYTES
+#define TGC_MIN_BYTES (1 << 20)
+#endif
+
 enum {
   TGC_MARK = 0x01,
   TGC_ROOT = 0x02,
-  TGC_LEAF = 0x04
+  TGC_LEAF = 0x04,
+  TGC_OLD  = 0x08,
+  TGC_REMEMBERED = 0x10
 };
 
 typedef struct {
@@ -25,7 +32,16 @@ typedef struct {
   uintptr_t minptr, maxptr;
   tgc_ptr_t *items, *frees;
   double loadfactor, sweepfactor;
-  size_t nitems, nslots, mitems, nfrees;
+  size_t nitems, nslots, nfrees;
+  /* a collection runs when nbytes goes past mbytes */
+  size_t nbytes, mbytes, minbytes;
+  /* generational mode */
+  int generational;
+  void **young, **remembered;
+  size_t nyoung, myoung, nremembered, mremembered, nursery;
+  /* statistics */
+  size_t nallocs, ncollections, allocated; /* allocated counts bytes */
+  double gctime, maxpause; /* seconds spent collecting, longest pause */
 } tgc_t;
 
 void tgc_start(tgc_t *gc, void *stk);
@@ -34,6 +50,17 @@ void tgc_pause(tgc_t *gc);
 void tgc_resume(tgc_t *gc);
 void tgc_run(tgc_t *gc);
 
+/* Generational mode: collections only happen at tgc_safepoint. Minor
+ * collections trace from the stack, the given roots and the remembered
+ * old blocks, and free only unreachable blocks allocated since the last
+ * collection. Survivors become old. Old blocks written to after a
+ * collection must be passed to tgc_write before the next safepoint.
+ */
+void tgc_generational(tgc_t *gc, size_t nursery);
+void tgc_write(tgc_t *gc, void *ptr);
+void tgc_safepoint(tgc_t *gc, void **roots, size_t nroots);
+void tgc_minor(tgc_t *gc, void **roots, size_t nroots);
+
 void *tgc_alloc(tgc_t *gc, size_t size);
 void *tgc_calloc(tgc_t *gc, size_t num, size_t size);
 void *tgc_realloc(tgc_t *gc, void *ptr, size_t size);